@@ -5,6 +5,7 @@
 #include <boost/program_options.hpp>
 #include <iomanip>
 #include <iostream>
+#include <sstream>
 
 using namespace GeoNLP;
 namespace po = boost::program_options;
@@ -23,8 +24,10 @@ int main(int argc, char *argv[])
   double      ref_longitude;
   int         ref_zoom       = 16;
   double      ref_importance = 0.75;
+  std::string viewport_coors;
 
   Geocoder::GeoReference reference;
+  BoundingBox            viewport;
 
   {
     po::options_description generic("Geocoder NLP demo options");
@@ -52,6 +55,11 @@ int main(int argc, char *argv[])
     generic.add_options()("ref-importance", po::value<double>(&ref_importance),
                           "Reference for location bias; importance from 0 to 1 of location bias");
 
+    generic.add_options()(
+        "viewport", po::value<std::string>(&viewport_coors),
+        "Restrict search to the viewport given as min_latitude,max_latitude,min_longitude,"
+        "max_longitude. Use --viewport=... form if the coordinates are negative.");
+
     po::options_description hidden("Hidden options");
     hidden.add_options()("query", po::value<std::string>(&query), "Search query");
 
@@ -97,6 +105,24 @@ int main(int argc, char *argv[])
 
     if (vm.count("ref-latitude") && vm.count("ref-longitude"))
       reference.set(ref_latitude, ref_longitude, ref_zoom, ref_importance);
+
+    if (vm.count("viewport"))
+      {
+        std::istringstream ss(viewport_coors);
+        double             c[4];
+        bool               ok = true;
+        for (int i = 0; i < 4 && ok; ++i)
+          {
+            char sep = ',';
+            ok       = (ss >> c[i]) && (i == 3 || ((ss >> sep) && sep == ','));
+          }
+        if (!ok || !(ss >> std::ws).eof())
+          {
+            std::cerr << "Viewport should be given by four comma-separated coordinates\n";
+            return -1;
+          }
+        viewport = BoundingBox(c[0], c[1], c[2], c[3]);
+      }
   }
 
   std::vector<Postal::ParseResult> parsed_query;
@@ -145,7 +171,7 @@ int main(int argc, char *argv[])
 
   std::cout << "Geocoder loaded" << std::endl;
 
-  geo.search(parsed_query, result, 0, reference);
+  geo.search(parsed_query, result, 0, reference, viewport);
 
   std::cout << std::setprecision(8);
   std::cout << "Search results: \n\n";
@@ -8,11 +8,38 @@ DEPENDPATH += $$PWD/src
 
 SOURCES += \
     $$PWD/src/postal.cpp \
-    $$PWD/src/geocoder.cpp
+    $$PWD/src/postalpool.cpp \
+    $$PWD/src/postalservice.cpp \
+    $$PWD/src/queryclassifier.cpp \
+    $$PWD/src/geocoder.cpp \
+    $$PWD/src/geocoderset.cpp \
+    $$PWD/src/mappedfile.cpp \
+    $$PWD/src/parsedquery.cpp \
+    $$PWD/src/batchgeocoder.cpp \
+    $$PWD/src/corridor.cpp \
+    $$PWD/src/corridorsearch.cpp \
+    $$PWD/src/expansioncache.cpp \
+    $$PWD/src/forkedworker.cpp \
+    $$PWD/src/polyline.cpp \
+    $$PWD/src/spatialcell.cpp
 
 HEADERS += \
     $$PWD/src/postal.h \
+    $$PWD/src/postalpool.h \
+    $$PWD/src/postalservice.h \
+    $$PWD/src/queryclassifier.h \
     $$PWD/src/geocoder.h \
+    $$PWD/src/geocoderset.h \
+    $$PWD/src/geometry.h \
+    $$PWD/src/mappedfile.h \
+    $$PWD/src/parsedquery.h \
+    $$PWD/src/batchgeocoder.h \
+    $$PWD/src/corridor.h \
+    $$PWD/src/corridorsearch.h \
+    $$PWD/src/expansioncache.h \
+    $$PWD/src/forkedworker.h \
+    $$PWD/src/polyline.h \
+    $$PWD/src/spatialcell.h \
     $$PWD/src/version.h
        
 LIBS += -lpostal 
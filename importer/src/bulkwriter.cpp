@@ -0,0 +1,141 @@
+#include "bulkwriter.h"
+
+#include <algorithm>
+#include <iostream>
+
+// limit on the number of bound parameters in a single statement,
+// kept below the SQLite default
+const size_t max_variables_per_statement = 999;
+
+BulkWriter::BulkWriter(sqlite3pp::database &db, const std::string &table,
+                       const std::vector<std::string> &columns)
+    : m_db(db), m_table(table), m_columns(columns.size())
+{
+  m_insert = "INSERT INTO " + table + " (";
+  m_row    = "(";
+  for (size_t i = 0; i < columns.size(); ++i)
+    {
+      if (i > 0)
+        {
+          m_insert += ", ";
+          m_row += ",";
+        }
+      m_insert += columns[i];
+      m_row += "?";
+    }
+  m_insert += ") VALUES ";
+  m_row += ")";
+
+  m_rows_per_statement = std::max(size_t(1), max_variables_per_statement / m_columns);
+  m_values.reserve(m_rows_per_statement * m_columns);
+}
+
+BulkWriter::~BulkWriter()
+{
+  try
+    {
+      flush();
+    }
+  catch (sqlite3pp::database_error &e)
+    {
+      std::cerr << "WriteSQL: error inserting rows into " << m_table << ": " << e.what() << "\n";
+    }
+}
+
+std::unique_ptr<sqlite3pp::command> BulkWriter::prepare(size_t rows)
+{
+  std::string sql = m_insert;
+  for (size_t i = 0; i < rows; ++i)
+    {
+      if (i > 0)
+        sql += ",";
+      sql += m_row;
+    }
+  return std::unique_ptr<sqlite3pp::command>(new sqlite3pp::command(m_db, sql.c_str()));
+}
+
+void BulkWriter::write()
+{
+  if (m_rows == 0)
+    return;
+
+  // full batches reuse the same statement, last incomplete batch is
+  // inserted using a statement prepared for it
+  std::unique_ptr<sqlite3pp::command> partial;
+  sqlite3pp::command                 *cmd;
+  if (m_rows == m_rows_per_statement)
+    {
+      if (!m_command)
+        m_command = prepare(m_rows_per_statement);
+      cmd = m_command.get();
+    }
+  else
+    {
+      partial = prepare(m_rows);
+      cmd     = partial.get();
+    }
+
+  cmd->reset();
+  bind(*cmd, 0, m_rows);
+  if (cmd->execute() == SQLITE_OK)
+    m_rows_written += m_rows;
+  else
+    write_rows();
+
+  m_rows = 0;
+  m_values.clear();
+}
+
+void BulkWriter::bind(sqlite3pp::command &cmd, size_t first, size_t rows)
+{
+  for (size_t i = 0; i < rows * m_columns; ++i)
+    {
+      const Value &v   = m_values[first * m_columns + i];
+      const int    idx = (int)i + 1;
+      if (std::holds_alternative<long long>(v))
+        cmd.bind(idx, std::get<long long>(v));
+      else if (std::holds_alternative<double>(v))
+        cmd.bind(idx, std::get<double>(v));
+      else
+        cmd.bind(idx, std::get<std::string>(v), sqlite3pp::nocopy);
+    }
+}
+
+// fallback for a failed batch: insert rows one by one to keep all
+// rows that can be inserted and report the ones that cannot
+void BulkWriter::write_rows()
+{
+  if (!m_single)
+    m_single = prepare(1);
+
+  for (size_t r = 0; r < m_rows; ++r)
+    {
+      m_single->reset();
+      bind(*m_single, r, 1);
+      if (m_single->execute() == SQLITE_OK)
+        {
+          ++m_rows_written;
+          continue;
+        }
+
+      std::cerr << "WriteSQL: error inserting row into " << m_table << ": " << m_db.error_msg()
+                << "\nRow:";
+      for (size_t c = 0; c < m_columns; ++c)
+        {
+          const Value &v = m_values[r * m_columns + c];
+          std::cerr << " ";
+          if (std::holds_alternative<long long>(v))
+            std::cerr << std::get<long long>(v);
+          else if (std::holds_alternative<double>(v))
+            std::cerr << std::get<double>(v);
+          else
+            std::cerr << std::get<std::string>(v);
+        }
+      std::cerr << "\n";
+    }
+}
+
+void BulkWriter::flush()
+{
+  write();
+}
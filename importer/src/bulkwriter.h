@@ -0,0 +1,75 @@
+#ifndef BULKWRITER_H
+#define BULKWRITER_H
+
+#include <memory>
+#include <sqlite3pp.h>
+#include <string>
+#include <type_traits>
+#include <variant>
+#include <vector>
+
+/// \brief Writer inserting rows into a table in batches
+///
+/// Rows are collected in memory and inserted by multi-row INSERT
+/// statements. Statements are prepared once and reused for all
+/// batches. Remaining rows are inserted on flush or destruction. If
+/// a batch fails, its rows are inserted one by one and the rows that
+/// cannot be inserted are reported.
+class BulkWriter
+{
+public:
+  BulkWriter(sqlite3pp::database &db, const std::string &table,
+             const std::vector<std::string> &columns);
+  ~BulkWriter();
+
+  BulkWriter(const BulkWriter &) = delete;
+  BulkWriter &operator=(const BulkWriter &) = delete;
+
+  /// \brief Add a row with values given in the order of columns
+  template <typename... T> void add(const T &...values)
+  {
+    static_assert(sizeof...(values) > 0, "Row cannot be empty");
+    (push(values), ...);
+    if (++m_rows == m_rows_per_statement)
+      write();
+  }
+
+  /// \brief Insert all collected rows
+  void flush();
+
+  size_t rows_written() const { return m_rows_written; }
+
+protected:
+  typedef std::variant<long long, double, std::string> Value;
+
+  template <typename T> void push(const T &v)
+  {
+    if constexpr (std::is_integral<T>::value)
+      m_values.emplace_back((long long)v);
+    else if constexpr (std::is_floating_point<T>::value)
+      m_values.emplace_back((double)v);
+    else
+      m_values.emplace_back(std::string(v));
+  }
+
+  std::unique_ptr<sqlite3pp::command> prepare(size_t rows);
+  void                                bind(sqlite3pp::command &cmd, size_t first, size_t rows);
+  void                                write();
+  void                                write_rows();
+
+protected:
+  sqlite3pp::database &m_db;
+  std::string          m_table;
+  std::string          m_insert;
+  std::string          m_row;
+  size_t               m_columns;
+  size_t               m_rows_per_statement;
+  size_t               m_rows         = 0;
+  size_t               m_rows_written = 0;
+  std::vector<Value>   m_values;
+
+  std::unique_ptr<sqlite3pp::command> m_command;
+  std::unique_ptr<sqlite3pp::command> m_single;
+};
+
+#endif
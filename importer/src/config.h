@@ -14,6 +14,13 @@
 
 #define MAX_COMMAS 10 /// maximal number of commas allowed in a name
 
+/// number of names sent to normalization worker process in one request
+#define NORMALIZATION_CHUNK_SIZE 1000
+
+/// number of normalized name and ID pairs kept in memory before they are
+/// written into a sorted run file
+#define NORMALIZED_NAMES_IN_MEMORY 20000000
+
 #define GEOCODER_IMPORTER_POSTGRES "GEOCODER_IMPORTER_POSTGRES"
 
 typedef uint64_t      hindex;
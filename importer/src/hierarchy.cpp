@@ -177,8 +177,17 @@ bool Hierarchy::check_indexing(bool verbose)
 
 void Hierarchy::write(sqlite3pp::database &db) const
 {
+  BulkWriter primary(db, "object_primary_tmp",
+                     { "id", "postgres_id", "name", "name_extra", "name_en", "phone",
+                       "postal_code", "website", "parent", "longitude", "latitude",
+                       "search_rank", "cell_id" });
+  BulkWriter type(db, "object_type_tmp", { "prim_id", "type" });
+  BulkWriter hierarchy(db, "hierarchy",
+                       { "prim_id", "last_subobject", "min_latitude", "max_latitude",
+                         "min_longitude", "max_longitude", "min_search_rank" });
+
   for (auto item : m_root_finalized)
-    item->write(db);
+    item->write(primary, type, hierarchy);
 }
 
 std::deque<std::shared_ptr<HierarchyItem> > Hierarchy::root_items() const
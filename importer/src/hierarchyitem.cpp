@@ -1,7 +1,10 @@
 #include "hierarchyitem.h"
 #include "postal.h"
+#include "spatialcell.h"
 #include "utils.h"
 
+#include <algorithm>
+
 #include <boost/algorithm/string/trim.hpp>
 #include <fstream>
 #include <iostream>
@@ -226,14 +229,27 @@ sqlid HierarchyItem::index(sqlid idx, sqlid parent)
     throw std::runtime_error("Trying to index a location that was not supposed to be kept");
   m_my_index     = idx;
   m_parent_index = parent;
+
+  m_subtree_min_latitude  = m_subtree_max_latitude  = m_latitude;
+  m_subtree_min_longitude = m_subtree_max_longitude = m_longitude;
+  m_subtree_search_rank   = m_search_rank;
+
   ++idx;
   for (auto item : m_children)
-    idx = item->index(idx, m_my_index);
+    {
+      idx = item->index(idx, m_my_index);
+
+      m_subtree_min_latitude  = std::min(m_subtree_min_latitude, item->m_subtree_min_latitude);
+      m_subtree_max_latitude  = std::max(m_subtree_max_latitude, item->m_subtree_max_latitude);
+      m_subtree_min_longitude = std::min(m_subtree_min_longitude, item->m_subtree_min_longitude);
+      m_subtree_max_longitude = std::max(m_subtree_max_longitude, item->m_subtree_max_longitude);
+      m_subtree_search_rank   = std::min(m_subtree_search_rank, item->m_subtree_search_rank);
+    }
   m_last_child_index = idx - 1;
   return idx;
 }
 
-void HierarchyItem::write(sqlite3pp::database &db) const
+void HierarchyItem::write(BulkWriter &primary, BulkWriter &type, BulkWriter &hierarchy) const
 {
   if (!keep())
     throw std::runtime_error("Trying to write a location that was not supposed to be kept");
@@ -243,43 +259,21 @@ void HierarchyItem::write(sqlite3pp::database &db) const
   std::string phone   = get_with_def(m_data_extra, "phone");
   std::string website = get_with_def(m_data_extra, "website");
 
-  {
-    sqlite3pp::command cmd(db,
-                           "INSERT INTO object_primary_tmp (id, postgres_id, name, name_extra, "
-                           "name_en, phone, postal_code, website, parent, longitude, "
-                           "latitude, search_rank) VALUES (?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?)");
-    cmd.binder() << m_my_index << (int)m_id << m_name << m_name_extra << name_en << phone
-                 << m_postcode << website << m_parent_index << m_longitude << m_latitude
-                 << m_search_rank;
-    if (cmd.execute() != SQLITE_OK)
-      std::cerr << "WriteSQL : error inserting primary data for " << m_id << ", " << m_my_index
-                << "\n";
-  }
+  primary.add(m_my_index, (int)m_id, m_name, m_name_extra, name_en, phone, m_postcode, website,
+              m_parent_index, m_longitude, m_latitude, m_search_rank,
+              (sqlid)GeoNLP::SpatialCell::id(m_latitude, m_longitude));
 
   // type
-  {
-    std::string command
-        //= "INSERT INTO object_type_tmp (prim_id, type) VALUES (?, \"" + type + "\")";
-        = "INSERT INTO object_type_tmp (prim_id, type) VALUES (?, ?)";
-    sqlite3pp::command cmd(db, command.c_str());
-    cmd.binder() << m_my_index << m_type;
-    if (cmd.execute() != SQLITE_OK)
-      std::cerr << "WriteSQL: error inserting type for " << m_id << ", " << m_my_index << "\n";
-  }
+  type.add(m_my_index, m_type);
 
   // hierarchy
   if (m_last_child_index > m_my_index)
-    {
-      sqlite3pp::command cmd(db, "INSERT INTO hierarchy (prim_id, last_subobject) VALUES (?, ?)");
-      cmd.binder() << m_my_index << m_last_child_index;
-      if (cmd.execute() != SQLITE_OK)
-        std::cerr << "WriteSQL: error inserting hierarchy for " << m_id << ", " << m_my_index
-                  << " - " << m_last_child_index << "\n";
-    }
+    hierarchy.add(m_my_index, m_last_child_index, m_subtree_min_latitude, m_subtree_max_latitude,
+                  m_subtree_min_longitude, m_subtree_max_longitude, m_subtree_search_rank);
 
   // children
   for (const auto &c : m_children)
-    c->write(db);
+    c->write(primary, type, hierarchy);
 }
 
 void HierarchyItem::print_item(unsigned int offset) const
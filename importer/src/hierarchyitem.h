@@ -1,6 +1,7 @@
 #ifndef HIERARCHYITEM_H
 #define HIERARCHYITEM_H
 
+#include "bulkwriter.h"
 #include "config.h"
 
 #include <deque>
@@ -33,7 +34,7 @@ public:
   void  set_parent(hindex parent, bool force = false);
   void  cleanup_children(bool duplicate_only = false);
   sqlid index(sqlid idx, sqlid parent);
-  void  write(sqlite3pp::database &db) const;
+  void  write(BulkWriter &primary, BulkWriter &type, BulkWriter &hierarchy) const;
 
   void print_item(unsigned int offset) const;
   void print_branch(unsigned int offset) const;
@@ -75,6 +76,14 @@ private:
 
   std::deque<std::shared_ptr<HierarchyItem> > m_children;
 
+  // bounding box and the best search rank of the item together with
+  // all its subobjects, filled on indexing
+  float m_subtree_min_latitude;
+  float m_subtree_max_latitude;
+  float m_subtree_min_longitude;
+  float m_subtree_max_longitude;
+  int   m_subtree_search_rank;
+
   static std::set<std::string> s_priority_types;
   static std::set<std::string> s_skip_types;
 };
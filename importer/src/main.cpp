@@ -24,6 +24,7 @@
 #include <pqxx/pqxx>
 #include <set>
 #include <sqlite3pp.h>
+#include <thread>
 
 using json   = nlohmann::json;
 namespace po = boost::program_options;
@@ -43,6 +44,7 @@ int main(int argc, char *argv[])
   std::string type_skip_list;
   std::string log_errors_to_file;
   bool        verbose_address_expansion = false;
+  size_t      normalization_workers     = std::max(1u, std::thread::hardware_concurrency());
 
   {
     po::options_description generic("Geocoder NLP importer options");
@@ -67,6 +69,10 @@ int main(int argc, char *argv[])
         "log-errors-to-file", po::value<std::string>(&log_errors_to_file),
         "Log errors to file and continue import. File name given as an argument of this option.");
     generic.add_options()("verbose", "Verbose address expansion");
+    generic.add_options()(
+        "workers", po::value<size_t>(&normalization_workers),
+        "Number of processes used for libpostal normalization. Each process shares libpostal "
+        "data loaded by the importer. Defaults to the number of CPU cores.");
 
     po::options_description hidden("Hidden options");
     hidden.add_options()("output-directory", po::value<std::string>(&database_path),
@@ -381,10 +387,12 @@ select place_id as parent_place_resolved from prec where linked_place_id is null
              "id INTEGER PRIMARY KEY AUTOINCREMENT, postgres_id INTEGER, name TEXT, name_extra "
              "TEXT, name_en TEXT, phone TEXT, postal_code TEXT, website TEXT, parent INTEGER, "
              "search_rank INTEGER, "
-             "latitude REAL, longitude REAL)");
+             "latitude REAL, longitude REAL, cell_id INTEGER)");
   db.execute("CREATE " TEMPORARY " TABLE object_type_tmp (prim_id INTEGER, type TEXT NOT NULL, "
              "FOREIGN KEY (prim_id) REFERENCES objects_primary_tmp(id))");
   db.execute("CREATE TABLE hierarchy (prim_id INTEGER PRIMARY KEY, last_subobject INTEGER, "
+             "min_latitude REAL, max_latitude REAL, min_longitude REAL, max_longitude REAL, "
+             "min_search_rank INTEGER, "
              "FOREIGN KEY (prim_id) REFERENCES objects_primary(id), FOREIGN KEY (last_subobject) "
              "REFERENCES objects_primary(id))");
 
@@ -403,53 +411,41 @@ select place_id as parent_place_resolved from prec where linked_place_id is null
              " TABLE object_primary_tmp2 (id INTEGER PRIMARY KEY AUTOINCREMENT, "
              "name TEXT, name_extra TEXT, name_en TEXT, phone TEXT, postal_code TEXT, website "
              "TEXT, parent INTEGER, type_id INTEGER, latitude REAL, longitude REAL, "
-             "search_rank INTEGER, boxstr TEXT, "
+             "search_rank INTEGER, cell_id INTEGER, "
              "FOREIGN KEY (type_id) REFERENCES type(id))");
 
   db.execute("INSERT INTO object_primary_tmp2 (id, name, name_extra, name_en, phone, postal_code, "
-             "website, parent, type_id, latitude, longitude, search_rank, boxstr) "
+             "website, parent, type_id, latitude, longitude, search_rank, cell_id) "
              "SELECT p.id, p.name, p.name_extra, p.name_en, p.phone, p.postal_code, p.website, "
-             "p.parent, type.id, p.latitude, p.longitude, p.search_rank, "
-             // LINE BELOW DETERMINES ROUNDING USED FOR BOXES
-             "CAST(CAST(p.latitude*100 AS INTEGER) AS TEXT) || ',' || CAST(CAST(p.longitude*100 AS "
-             "INTEGER) AS TEXT) "
+             "p.parent, type.id, p.latitude, p.longitude, p.search_rank, p.cell_id "
              "FROM object_primary_tmp p JOIN object_type_tmp tt ON p.id=tt.prim_id "
              "JOIN type ON tt.type=type.name");
 
-  db.execute("CREATE " TEMPORARY " TABLE boxids (id INTEGER PRIMARY KEY AUTOINCREMENT, boxstr "
-             "TEXT, CONSTRAINT struni UNIQUE (boxstr))");
-  db.execute("INSERT INTO boxids (boxstr) SELECT DISTINCT boxstr FROM object_primary_tmp2");
-
   db.execute("CREATE TABLE object_primary (id INTEGER PRIMARY KEY AUTOINCREMENT, name TEXT, "
              "name_extra TEXT, name_en TEXT, phone TEXT, postal_code TEXT, website TEXT, "
              "parent INTEGER, type_id INTEGER, latitude REAL, longitude REAL, search_rank INTEGER, "
-             "box_id INTEGER, "
+             "cell_id INTEGER, "
              "FOREIGN KEY (type_id) REFERENCES type(id))");
   db.execute(
       "INSERT INTO object_primary (id, name, name_extra, name_en, phone, postal_code, website, "
-      "parent, type_id, latitude, longitude, search_rank, box_id) "
-      "SELECT o.id, name, name_extra, name_en, phone, postal_code, website, parent, type_id, "
-      "latitude, longitude, search_rank, b.id FROM object_primary_tmp2 o JOIN boxids b ON "
-      "o.boxstr=b.boxstr");
+      "parent, type_id, latitude, longitude, search_rank, cell_id) "
+      "SELECT id, name, name_extra, name_en, phone, postal_code, website, parent, type_id, "
+      "latitude, longitude, search_rank, cell_id FROM object_primary_tmp2");
 
-  db.execute("DROP INDEX IF EXISTS idx_object_primary_box");
-  db.execute("CREATE INDEX idx_object_primary_box ON object_primary (box_id)");
+  db.execute("DROP INDEX IF EXISTS idx_object_primary_cell");
+  db.execute("CREATE INDEX idx_object_primary_cell ON object_primary (cell_id)");
 
   db.execute("DROP INDEX IF EXISTS idx_object_primary_postal_code");
   db.execute("CREATE INDEX idx_object_primary_postal_code ON object_primary (postal_code)");
 
   std::cout << "Normalize using libpostal" << std::endl;
 
-  normalize_libpostal(db, postal_address_parser_dir, verbose_address_expansion);
-  normalized_to_final(db, database_path);
-
-  // Create R*Tree for nearest neighbor search
-  std::cout << "Populating R*Tree" << std::endl;
-  db.execute(
-      "CREATE VIRTUAL TABLE object_primary_rtree USING rtree(id, minLat, maxLat, minLon, maxLon)");
-  db.execute("INSERT INTO object_primary_rtree (id, minLat, maxLat, minLon, maxLon) "
-             "SELECT box_id, min(latitude), max(latitude), min(longitude), max(longitude) from "
-             "object_primary group by box_id");
+  {
+    NormalizedNames names(GeoNLP::Geocoder::name_normalized_id(database_path) + ".run");
+    normalize_libpostal(db, postal_address_parser_dir, verbose_address_expansion,
+                        normalization_workers, names);
+    normalized_to_final(names, database_path);
+  }
 
   // Stats view
   db.execute("DROP VIEW IF EXISTS type_stats");
@@ -479,6 +475,16 @@ select place_id as parent_place_resolved from prec where linked_place_id is null
       std::cerr << "WriteSQL: error inserting version information\n";
   }
 
+  // Recording extent of the imported region
+  db.execute("INSERT INTO meta (key, value) SELECT \"bbox:min_latitude\", min(latitude) "
+             "FROM object_primary");
+  db.execute("INSERT INTO meta (key, value) SELECT \"bbox:max_latitude\", max(latitude) "
+             "FROM object_primary");
+  db.execute("INSERT INTO meta (key, value) SELECT \"bbox:min_longitude\", min(longitude) "
+             "FROM object_primary");
+  db.execute("INSERT INTO meta (key, value) SELECT \"bbox:max_longitude\", max(longitude) "
+             "FROM object_primary");
+
   if (!postal_country_parser.empty())
     {
       std::cout << "Recording postal parser country preference: " << postal_country_parser << "\n";
@@ -1,21 +1,213 @@
 #include "normalization.h"
 #include "config.h"
+#include "forkedworker.h"
 #include "geocoder.h"
 
+#include <algorithm>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
 #include <kchashdb.h>
 #include <libpostal/libpostal.h>
+#include <map>
 #include <marisa.h>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <thread>
+#include <unordered_map>
+
+using GeoNLP::ForkedWorker;
+
+namespace
+{
+struct tonorm
+{
+  std::string name;
+  sqlid       id;
+};
+
+std::string make_request(const std::deque<tonorm> &data, size_t begin, size_t end)
+{
+  std::string request;
+  ForkedWorker::write_size(request, end - begin);
+  for (size_t i = begin; i < end; ++i)
+    {
+      ForkedWorker::write_size(request, data[i].id);
+      ForkedWorker::write_string(request, data[i].name);
+    }
+  return request;
+}
 
 ////////////////////////////////////////////////////////////////////////////
-/// Libpostal normalization with search string expansion
-void normalize_libpostal(sqlite3pp::database &db, std::string address_expansion_dir, bool verbose)
+/// Normalize and expand a single name. Normalized strings are
+/// appended to the response in the order they have to be inserted,
+/// messages are collected into the log.
+void normalize_name(const std::string &name, sqlid id, bool verbose, std::string &log,
+                    std::vector<std::string> &names)
 {
-  struct tonorm
+  std::ostringstream out;
+  std::vector<char>  charbuff(name.c_str(), name.c_str() + name.length() + 1);
+
+  if (verbose)
+    out << name << ": ";
+
+  // check for sanity before we proceed with expansion
+  if (name.length() > LENGTH_STARTING_SUSP_CHECK)
+    {
+      size_t digits_space = 0;
+      for (size_t i = 0; i < name.length(); ++i)
+        if (std::isdigit(charbuff[i]) || std::isspace(charbuff[i]))
+          digits_space++;
+
+      if ((digits_space * 1.0) / name.length() > 0.5)
+        {
+          out << "Warning: dropping suspicious name: " << name << "\n";
+          log = out.str();
+          return;
+        }
+    }
+
+  // check if there are too many commas
+  if (std::count(name.begin(), name.end(), ',') > MAX_COMMAS)
+    {
+      out << "Warning: dropping suspicious name - too many commas: " << name << "\n";
+      log = out.str();
+      return;
+    }
+
+  // normalized, but not expanded string
   {
-    std::string name;
-    sqlid       id;
-  };
+    char *normalized
+        = libpostal_normalize_string(charbuff.data(), LIBPOSTAL_NORMALIZE_DEFAULT_STRING_OPTIONS);
+    if (normalized != NULL)
+      {
+        names.push_back(normalized);
+        free(normalized);
+      }
+  }
+
+  size_t                        num_expansions;
+  libpostal_normalize_options_t options = libpostal_get_default_options();
+  char **expansions = libpostal_expand_address(charbuff.data(), options, &num_expansions);
+
+  if (num_expansions > MAX_NUMBER_OF_EXPANSIONS)
+    {
+      out << "Warning: large number [" << num_expansions
+          << "] of normalization expansions of " << name << " - dropping it from the table ["
+          << id << "]\n";
+      libpostal_expansion_array_destroy(expansions, num_expansions);
+      log = out.str();
+      return; // don't insert it, its probably wrong anyway
+    }
+
+  for (size_t i = 0; i < num_expansions; i++)
+    {
+      std::string s = expansions[i];
+      names.push_back(s);
+
+      // to cover the street names that have Dr. or the firstname
+      // in the front of the mainly used name, add substrings into
+      // the normalized table as well
+      const size_t max_substrings = 2;
+      size_t       pos            = 1;
+      for (size_t sbs = 0; sbs < max_substrings && pos < s.length(); ++sbs)
+        {
+          bool spacefound = false;
+          for (; pos < s.length(); ++pos)
+            {
+              char c = s[pos];
+              if (c == ' ')
+                spacefound = true;
+              if (spacefound && c != ' ')
+                break;
+            }
+
+          if (pos < s.length())
+            names.push_back(s.substr(pos));
+        }
+    }
+
+  // Free expansions
+  libpostal_expansion_array_destroy(expansions, num_expansions);
+
+  if (verbose)
+    out << "done\n";
+
+  log = out.str();
+}
+
+////////////////////////////////////////////////////////////////////////////
+/// Normalize all names in the request. Called either in the worker
+/// process or, if workers are not used, in the importer itself.
+std::string normalize_chunk(const std::string &request, bool verbose)
+{
+  std::string response;
+  size_t      pos = 0;
+  uint64_t    n;
+  if (!ForkedWorker::read_size(request, pos, n))
+    return response;
+
+  ForkedWorker::write_size(response, n);
+  for (uint64_t i = 0; i < n; ++i)
+    {
+      uint64_t                 id;
+      std::string              name, log;
+      std::vector<std::string> names;
+      if (!ForkedWorker::read_size(request, pos, id)
+          || !ForkedWorker::read_string(request, pos, name))
+        return std::string();
+
+      normalize_name(name, (sqlid)id, verbose, log, names);
+
+      ForkedWorker::write_string(response, log);
+      ForkedWorker::write_strings(response, names);
+    }
+
+  return response;
+}
+
+////////////////////////////////////////////////////////////////////////////
+/// Normalization result of a single name
+struct normalized
+{
+  std::string              log;
+  std::vector<std::string> names;
+};
+
+////////////////////////////////////////////////////////////////////////////
+/// Read normalization results of the request
+bool read_chunk(const std::string &response, size_t begin, size_t end,
+                std::vector<normalized> &results)
+{
+  size_t   pos = 0;
+  uint64_t n;
+  if (!ForkedWorker::read_size(response, pos, n) || n != end - begin)
+    return false;
+
+  for (size_t i = begin; i < end; ++i)
+    {
+      normalized &r = results[i];
+      if (!ForkedWorker::read_string(response, pos, r.log)
+          || !ForkedWorker::read_strings(response, pos, r.names))
+        return false;
+    }
 
+  return true;
+}
+
+}
+
+////////////////////////////////////////////////////////////////////////////
+/// Libpostal normalization with search string expansion
+///
+/// Distinct names are split into chunks that are normalized by forked
+/// worker processes. As libpostal is loaded before forking, its data is
+/// shared by the workers. Results are added in the order of the
+/// chunks, so the output does not depend on the number of workers.
+void normalize_libpostal(sqlite3pp::database &db, std::string address_expansion_dir, bool verbose,
+                         size_t workers, NormalizedNames &names)
+{
   std::deque<tonorm> data;
   sqlite3pp::query   qry(db, "SELECT id, name, name_extra, name_en FROM object_primary_tmp");
   for (auto v : qry)
@@ -44,11 +236,31 @@ void normalize_libpostal(sqlite3pp::database &db, std::string address_expansion_
         }
     }
 
-  // make a new table for normalized names
-  db.execute("DROP TABLE IF EXISTS normalized_name");
-  db.execute(
-      "CREATE " TEMPORARY
-      " TABLE normalized_name (prim_id INTEGER, name TEXT NOT NULL, PRIMARY KEY (name, prim_id))");
+  // many names are repeated, such as street names in different
+  // towns or brands. each distinct name is normalized only once and
+  // the results are used for all objects with that name. distinct
+  // names are kept in the order of their first occurrence
+  std::deque<tonorm>  distinct;
+  std::vector<size_t> data_distinct(data.size());
+  std::vector<size_t> last_use;
+  {
+    std::unordered_map<std::string, size_t> index;
+    for (size_t i = 0; i < data.size(); ++i)
+      {
+        auto r = index.insert(std::make_pair(data[i].name, distinct.size()));
+        if (r.second)
+          {
+            distinct.push_back(data[i]);
+            last_use.push_back(i);
+          }
+        data_distinct[i]          = r.first->second;
+        last_use[r.first->second] = i;
+      }
+  }
+
+  std::cout << "Distinct names: " << distinct.size() << " out of " << data.size()
+            << ", dedup ratio: "
+            << (distinct.empty() ? 1.0 : (data.size() * 1.0) / distinct.size()) << std::endl;
 
   // load libpostal
   if (!libpostal_setup() || !libpostal_setup_language_classifier())
@@ -66,132 +278,106 @@ void normalize_libpostal(sqlite3pp::database &db, std::string address_expansion_
       return;
     }
 
-  // normalize all names
-  size_t                        num_expansions;
-  size_t                        num_doubles_dropped = 0;
-  libpostal_normalize_options_t options             = libpostal_get_default_options();
-  std::vector<char>             charbuff;
-  for (tonorm &d : data)
-    {
-      charbuff.resize(d.name.length() + 1);
-      std::copy(d.name.c_str(), d.name.c_str() + d.name.length() + 1, charbuff.begin());
+  const size_t chunk_size = NORMALIZATION_CHUNK_SIZE;
+  const size_t nchunks    = (distinct.size() + chunk_size - 1) / chunk_size;
 
-      if (verbose)
-        std::cout << d.name << ": " << std::flush;
+  auto chunk_end = [&](size_t c) { return std::min(distinct.size(), (c + 1) * chunk_size); };
 
-      // check for sanity before we proceed with expansion
-      if (d.name.length() > LENGTH_STARTING_SUSP_CHECK)
+  // start workers. with a single worker, normalization is done in
+  // this process
+  std::vector<std::unique_ptr<ForkedWorker> > pool;
+  if (workers > 1 && nchunks > 1)
+    {
+      std::cout << std::flush;
+      for (size_t i = 0; i < workers; ++i)
         {
-          size_t digits_space = 0;
-          for (size_t i = 0; i < d.name.length(); ++i)
-            if (std::isdigit(charbuff[i]) || std::isspace(charbuff[i]))
-              digits_space++;
-
-          if ((digits_space * 1.0) / d.name.length() > 0.5)
-            {
-              std::cout << "Warning: dropping suspicious name: " << d.name << "\n";
-              continue;
-            }
+          std::unique_ptr<ForkedWorker> w(new ForkedWorker);
+          if (w->start([verbose](const std::string &r) { return normalize_chunk(r, verbose); }))
+            pool.push_back(std::move(w));
         }
+      std::cout << "Normalizing " << distinct.size() << " names using " << pool.size()
+                << " worker processes" << std::endl;
+    }
 
-      // check if there are too many commas
-      if (std::count(d.name.begin(), d.name.end(), ',') > MAX_COMMAS)
+  // chunks are normalized by workers ahead of insertion, but not
+  // further than the window
+  const size_t                  window = 4 * std::max(pool.size(), size_t(1));
+  std::mutex                    mutex;
+  std::condition_variable       cond;
+  size_t                        next_chunk = 0;
+  size_t                        inserted   = 0;
+  std::map<size_t, std::string> ready;
+  std::vector<std::thread>      threads;
+
+  for (auto &w : pool)
+    threads.emplace_back([&, worker = w.get()]() {
+      while (true)
         {
-          std::cout << "Warning: dropping suspicious name - too many commas: " << d.name << "\n";
-          continue;
-        }
-
-      // insert normalized, but not expanded string
-      {
-        char *normalized = libpostal_normalize_string(charbuff.data(),
-                                                      LIBPOSTAL_NORMALIZE_DEFAULT_STRING_OPTIONS);
-        if (normalized != NULL)
+          size_t c;
           {
-            sqlite3pp::command cmd(db, "INSERT INTO normalized_name (prim_id, name) VALUES (?,?)");
-            std::string        s = normalized;
-            cmd.binder() << d.id << s;
-            if (cmd.execute() != SQLITE_OK)
-              {
-                // std::cerr << "Error inserting: " << d.id << " " << s << std::endl;
-                num_doubles_dropped++;
-              }
-
-            free(normalized);
+            std::unique_lock<std::mutex> lk(mutex);
+            cond.wait(lk, [&] { return next_chunk >= nchunks || next_chunk < inserted + window; });
+            if (next_chunk >= nchunks)
+              return;
+            c = next_chunk++;
           }
-      }
 
-      char **expansions = libpostal_expand_address(charbuff.data(), options, &num_expansions);
+          // on failure, empty response is returned and the chunk is
+          // normalized by the importer itself
+          std::string response;
+          if (worker->running()
+              && !worker->call(make_request(distinct, c * chunk_size, chunk_end(c)), response))
+            response.clear();
 
-      if (num_expansions > MAX_NUMBER_OF_EXPANSIONS)
+          std::lock_guard<std::mutex> lk(mutex);
+          ready[c] = std::move(response);
+          cond.notify_all();
+        }
+    });
+
+  // objects are added in the input order as soon as their names are
+  // normalized. results are released after the last object using
+  // them is added
+  std::vector<normalized> results(distinct.size());
+  size_t                  next_record = 0;
+  for (size_t c = 0; c < nchunks; ++c)
+    {
+      std::string response;
+      if (!threads.empty())
         {
-          std::cout << "Warning: large number [" << num_expansions
-                    << "] of normalization expansions of " << d.name
-                    << " - dropping it from the table [" << d.id << "]\n";
-          // for (size_t i=0; i < 10 && i < num_expansions; i++)
-          //   std::cout << "   example expansion: " << expansions[i] << "\n";
-          // std::cout << "\n";
-
-          continue; // don't insert it, its probably wrong anyway
+          std::unique_lock<std::mutex> lk(mutex);
+          cond.wait(lk, [&] { return ready.count(c) > 0; });
+          response = std::move(ready[c]);
+          ready.erase(c);
+          inserted = c + 1;
+          cond.notify_all();
         }
 
-      for (size_t i = 0; i < num_expansions; i++)
-        {
-          sqlite3pp::command cmd(db, "INSERT INTO normalized_name (prim_id, name) VALUES (?,?)");
-          std::string        s = expansions[i];
-          cmd.binder() << d.id << s;
-          if (cmd.execute() != SQLITE_OK)
-            {
-              // std::cerr << "Error inserting: " << d.id << " " << s << std::endl;
-              num_doubles_dropped++;
-            }
+      const size_t begin = c * chunk_size;
+      if (response.empty())
+        response = normalize_chunk(make_request(distinct, begin, chunk_end(c)), verbose);
 
-          // to cover the street names that have Dr. or the firstname
-          // in the front of the mainly used name, add substrings into
-          // the normalized table as well
-          const size_t max_substrings = 2;
-          size_t       pos            = 1;
-          for (size_t sbs = 0; sbs < max_substrings && pos < s.length(); ++sbs)
-            {
-              bool spacefound = false;
-              for (; pos < s.length(); ++pos)
-                {
-                  char c = s[pos];
-                  if (c == ' ')
-                    spacefound = true;
-                  if (spacefound && c != ' ')
-                    break;
-                }
-
-              if (pos < s.length())
-                {
-                  try
-                    {
-                      sqlite3pp::command cmd(
-                          db, "INSERT INTO normalized_name (prim_id, name) VALUES (?,?)");
-                      std::string s = expansions[i];
-                      cmd.binder() << d.id << s.substr(pos);
-                      if (cmd.execute() != SQLITE_OK)
-                        {
-                          // std::cerr << "Error inserting: " << d.id << " " << s << std::endl;
-                          num_doubles_dropped++;
-                        }
-                    }
-                  catch (sqlite3pp::database_error &e)
-                    {
-                      num_doubles_dropped++;
-                    }
-                }
-            }
-        }
+      if (!read_chunk(response, begin, chunk_end(c), results))
+        std::cerr << "Error: failed to read normalization results" << std::endl;
 
-      // Free expansions
-      libpostal_expansion_array_destroy(expansions, num_expansions);
+      for (; next_record < data.size() && data_distinct[next_record] < chunk_end(c); ++next_record)
+        {
+          const size_t k = data_distinct[next_record];
+          normalized  &r = results[k];
+
+          std::cout << r.log << std::flush;
+          r.log.clear();
 
-      if (verbose)
-        std::cout << "done" << std::endl;
+          for (const std::string &n : r.names)
+            names.add(data[next_record].id, n);
+          if (last_use[k] == next_record)
+            std::vector<std::string>().swap(r.names);
+        }
     }
 
-  std::cout << "Redundant records skipped: " << num_doubles_dropped << "\n";
+  for (std::thread &t : threads)
+    t.join();
+  pool.clear();
 
   // Teardown libpostal
   libpostal_teardown_parser();
@@ -200,62 +386,39 @@ void normalize_libpostal(sqlite3pp::database &db, std::string address_expansion_
 }
 
 ////////////////////////////////////////////////////////////////////////////
-/// Libpostal normalization with search string expansion
-void normalized_to_final(sqlite3pp::database &db, std::string path)
+/// Build MARISA trie and ID database from normalized names
+///
+/// Names are read in sorted order with duplicates removed. Posting
+/// lists are collected in the order of the keyset and matched with
+/// the trie keys using key IDs assigned by the build.
+void normalized_to_final(NormalizedNames &names, std::string path)
 {
   std::cout << "Inserting normalized data into MARISA trie" << std::endl;
 
-  marisa::Keyset keyset;
+  marisa::Keyset                                keyset;
+  std::vector<GeoNLP::Geocoder::index_id_value> ids;
+  std::vector<size_t>                           offsets(1, 0);
+
+  const size_t pairs_added = names.pairs_added();
+  if (!names.for_each([&](const std::string &name, const std::vector<sqlid> &prim_ids) {
+        // weight corresponds to the number of name records, as if
+        // each of them was added separately
+        keyset.push_back(name.c_str(), name.length(), (float)prim_ids.size());
+        ids.insert(ids.end(), prim_ids.begin(), prim_ids.end());
+        offsets.push_back(ids.size());
+      }))
+    {
+      std::cerr << "Error: failed to read normalized names" << std::endl;
+      return;
+    }
 
-  {
-    sqlite3pp::query qry(db, "SELECT name FROM normalized_name");
-    for (auto v : qry)
-      {
-        std::string name;
-        v.getter() >> name;
-        keyset.push_back(name.c_str());
-      }
-  }
+  std::cout << "Normalized names: " << pairs_added << ", redundant records skipped: "
+            << names.pairs_dropped() << "\n";
 
   marisa::Trie trie;
   trie.build(keyset);
   trie.save(GeoNLP::Geocoder::name_normalized_trie(path).c_str());
 
-  struct norm
-  {
-    std::string name;
-    sqlid       prim_id;
-  };
-
-  std::deque<norm> data;
-  {
-    sqlite3pp::query qry(db, "SELECT name, prim_id FROM normalized_name");
-    for (auto v : qry)
-      {
-        norm d;
-        v.getter() >> d.name >> d.prim_id;
-        data.push_back(d);
-      }
-  }
-
-  std::map<GeoNLP::Geocoder::index_id_key, std::vector<GeoNLP::Geocoder::index_id_value> > bdata;
-  for (auto d : data)
-    {
-      marisa::Agent agent;
-      agent.set_query(d.name.c_str());
-      if (trie.lookup(agent))
-        {
-          GeoNLP::Geocoder::index_id_key k = agent.key().id();
-          if (bdata.count(k) == 0)
-            bdata[k] = std::vector<GeoNLP::Geocoder::index_id_value>();
-          bdata[k].push_back(d.prim_id);
-        }
-      else
-        {
-          std::cerr << "Error: cannot find in MARISA trie: " << d.name << std::endl;
-        }
-    }
-
   {
     // create the database object
     kyotocabinet::HashDB db;
@@ -272,18 +435,20 @@ void normalized_to_final(sqlite3pp::database &db, std::string path)
         return;
       }
 
-    std::vector<std::string> keys;
-    for (auto a : bdata)
-      keys.push_back(GeoNLP::Geocoder::make_id_key(a.first));
+    // records are written in the order of sorted keys
+    std::vector<std::pair<std::string, size_t> > keys;
+    keys.reserve(keyset.size());
+    for (size_t i = 0; i < keyset.size(); ++i)
+      keys.emplace_back(GeoNLP::Geocoder::make_id_key(keyset[i].id()), i);
 
     std::sort(keys.begin(), keys.end());
 
-    for (auto key : keys)
+    for (const auto &key : keys)
       {
-        std::vector<GeoNLP::Geocoder::index_id_value> &d = bdata[GeoNLP::Geocoder::get_id_key(key)];
-        std::sort(d.begin(), d.end());
+        std::vector<GeoNLP::Geocoder::index_id_value> d(ids.begin() + offsets[key.second],
+                                                        ids.begin() + offsets[key.second + 1]);
         std::string value = GeoNLP::Geocoder::make_id_value(d);
-        if (!db.set(key, value))
+        if (!db.set(key.first, value))
           {
             std::cerr << "set error: " << db.error().name() << std::endl;
             return;
@@ -294,6 +459,4 @@ void normalized_to_final(sqlite3pp::database &db, std::string path)
 
     db.close();
   }
-
-  db.execute("DROP TABLE IF EXISTS normalized_name");
 }
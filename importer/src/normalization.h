@@ -1,11 +1,14 @@
 #ifndef GEOCODER_NORMALIZATION_H
 #define GEOCODER_NORMALIZATION_H
 
+#include "normalizednames.h"
+
 #include <sqlite3pp.h>
 #include <string>
 
-void normalize_libpostal(sqlite3pp::database &db, std::string address_expansion_dir, bool verbose);
+void normalize_libpostal(sqlite3pp::database &db, std::string address_expansion_dir, bool verbose,
+                         size_t workers, NormalizedNames &names);
 
-void normalized_to_final(sqlite3pp::database &db, std::string path);
+void normalized_to_final(NormalizedNames &names, std::string path);
 
 #endif
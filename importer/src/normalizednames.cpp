@@ -0,0 +1,178 @@
+#include "normalizednames.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <limits>
+#include <memory>
+#include <queue>
+
+namespace
+{
+// sequential reader of a run file
+class RunReader
+{
+public:
+  RunReader(const std::string &fname) : m_file(fname, std::ios::binary) {}
+
+  bool next(std::string &name, sqlid &id)
+  {
+    uint64_t len;
+    if (!m_file.read((char *)&len, sizeof(len)))
+      return false;
+    name.resize(len);
+    return m_file.read(&name[0], len) && m_file.read((char *)&id, sizeof(id));
+  }
+
+  // true if reading stopped before the end of file
+  bool failed() const { return !m_file.eof(); }
+
+private:
+  std::ifstream m_file;
+};
+}
+
+NormalizedNames::NormalizedNames(const std::string &run_prefix, size_t max_pairs)
+    : m_run_prefix(run_prefix), m_max_pairs(std::max(size_t(1), max_pairs))
+{
+}
+
+NormalizedNames::~NormalizedNames()
+{
+  remove_runs();
+}
+
+void NormalizedNames::add(sqlid id, const std::string &name)
+{
+  m_pairs.emplace_back(name, id);
+  m_pairs_added++;
+  if (m_pairs.size() >= m_max_pairs && !spill())
+    {
+      // keep all remaining pairs in memory
+      std::cerr << "Failed to write sorted run of normalized names, continuing in memory\n";
+      m_max_pairs = std::numeric_limits<size_t>::max();
+    }
+}
+
+void NormalizedNames::sort_unique()
+{
+  std::sort(m_pairs.begin(), m_pairs.end());
+  auto last = std::unique(m_pairs.begin(), m_pairs.end());
+  m_pairs_dropped += std::distance(last, m_pairs.end());
+  m_pairs.erase(last, m_pairs.end());
+}
+
+bool NormalizedNames::spill()
+{
+  sort_unique();
+
+  std::string   fname = m_run_prefix + std::to_string(m_runs.size());
+  std::ofstream f(fname, std::ios::binary | std::ios::trunc);
+  for (const Pair &p : m_pairs)
+    {
+      uint64_t len = p.first.length();
+      f.write((const char *)&len, sizeof(len));
+      f.write(p.first.data(), len);
+      f.write((const char *)&p.second, sizeof(p.second));
+    }
+  f.close();
+
+  if (!f)
+    {
+      std::remove(fname.c_str());
+      return false;
+    }
+
+  m_runs.push_back(fname);
+  std::vector<Pair>().swap(m_pairs);
+  return true;
+}
+
+void NormalizedNames::remove_runs()
+{
+  for (const std::string &fname : m_runs)
+    std::remove(fname.c_str());
+  m_runs.clear();
+}
+
+bool NormalizedNames::for_each(Callback callback)
+{
+  sort_unique();
+
+  // merge sorted runs and pairs in memory. pairs in memory are given
+  // the last source index
+  struct Head
+  {
+    Pair   pair;
+    size_t source;
+  };
+
+  auto greater = [](const Head &a, const Head &b) {
+    return a.pair > b.pair || (a.pair == b.pair && a.source > b.source);
+  };
+
+  std::vector<std::unique_ptr<RunReader> >                           readers;
+  std::priority_queue<Head, std::vector<Head>, decltype(greater)> heads(greater);
+  size_t                                                             memory_pos = 0;
+
+  for (const std::string &fname : m_runs)
+    readers.emplace_back(new RunReader(fname));
+
+  const size_t memory_source = readers.size();
+  auto         advance       = [&](size_t source) {
+    Head h;
+    h.source = source;
+    if (source == memory_source)
+      {
+        if (memory_pos < m_pairs.size())
+          {
+            h.pair = std::move(m_pairs[memory_pos++]);
+            heads.push(std::move(h));
+          }
+      }
+    else if (readers[source]->next(h.pair.first, h.pair.second))
+      heads.push(std::move(h));
+  };
+
+  for (size_t s = 0; s <= memory_source; ++s)
+    advance(s);
+
+  std::string        name;
+  std::vector<sqlid> ids;
+  while (!heads.empty())
+    {
+      Head h = heads.top();
+      heads.pop();
+      advance(h.source);
+
+      if (!ids.empty() && h.pair.first == name)
+        {
+          if (ids.back() == h.pair.second)
+            m_pairs_dropped++;
+          else
+            ids.push_back(h.pair.second);
+        }
+      else
+        {
+          if (!ids.empty())
+            callback(name, ids);
+          name = std::move(h.pair.first);
+          ids.assign(1, h.pair.second);
+        }
+    }
+
+  if (!ids.empty())
+    callback(name, ids);
+
+  bool ok = true;
+  for (const auto &r : readers)
+    ok = ok && !r->failed();
+
+  std::vector<Pair>().swap(m_pairs);
+  readers.clear();
+  remove_runs();
+
+  return ok;
+}
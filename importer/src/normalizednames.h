@@ -0,0 +1,57 @@
+#ifndef NORMALIZEDNAMES_H
+#define NORMALIZEDNAMES_H
+
+#include "config.h"
+
+#include <functional>
+#include <string>
+#include <utility>
+#include <vector>
+
+/// \brief Collection of normalized names and IDs of objects using them
+///
+/// Pairs are kept in memory. When the number of pairs exceeds the
+/// limit, they are sorted and spilled into a run file. Runs and the
+/// pairs left in memory are merged when the collection is read.
+class NormalizedNames
+{
+public:
+  typedef std::function<void(const std::string &name, const std::vector<sqlid> &ids)> Callback;
+
+public:
+  NormalizedNames(const std::string &run_prefix, size_t max_pairs = NORMALIZED_NAMES_IN_MEMORY);
+  ~NormalizedNames();
+
+  NormalizedNames(const NormalizedNames &) = delete;
+  NormalizedNames &operator=(const NormalizedNames &) = delete;
+
+  void add(sqlid id, const std::string &name);
+
+  /// \brief Call callback for each distinct name
+  ///
+  /// Names are given in sorted order, together with the sorted IDs of
+  /// objects using them. Duplicate pairs are dropped. The collection
+  /// is empty after the call. Returns false on I/O error.
+  bool for_each(Callback callback);
+
+  size_t pairs_added() const { return m_pairs_added; }
+  size_t pairs_dropped() const { return m_pairs_dropped; }
+  size_t runs() const { return m_runs.size(); }
+
+protected:
+  typedef std::pair<std::string, sqlid> Pair;
+
+  void sort_unique();
+  bool spill();
+  void remove_runs();
+
+protected:
+  std::string              m_run_prefix;
+  size_t                   m_max_pairs;
+  std::vector<Pair>        m_pairs;
+  std::vector<std::string> m_runs;
+  size_t                   m_pairs_added   = 0;
+  size_t                   m_pairs_dropped = 0;
+};
+
+#endif
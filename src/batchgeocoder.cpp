@@ -0,0 +1,148 @@
+#include "batchgeocoder.h"
+
+#include <condition_variable>
+#include <deque>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <thread>
+
+using namespace GeoNLP;
+
+bool BatchGeocoder::run(const std::vector<std::string> &queries, Callback callback,
+                        size_t min_levels, const Geocoder::GeoReference &reference,
+                        const BoundingBox &viewport)
+{
+  if (m_geocoders.empty())
+    {
+      std::cerr << "BatchGeocoder: no geocoders added\n";
+      return false;
+    }
+
+  struct Item
+  {
+    size_t      index;
+    bool        ok;
+    ParsedQuery parsed;
+  };
+
+  // window of queries that are parsed, but not delivered yet. it
+  // should fit at least one parsed batch
+  const size_t window = std::max(m_queue_size, m_parse_batch_size);
+
+  std::mutex              mutex;
+  std::condition_variable cv_parsed; // new parsed query or parsing finished
+  std::condition_variable cv_space;  // results delivered
+  std::deque<Item>        queue;
+  bool                    parsing_done = false;
+  bool                    parsing_ok   = true;
+  size_t                  delivered    = 0;
+
+  std::map<size_t, std::vector<Geocoder::GeoResult> > done;
+  std::mutex                                          deliver_mutex;
+
+  // parser stage
+  auto parse = [&]() {
+    for (size_t start = 0; start < queries.size(); start += m_parse_batch_size)
+      {
+        const size_t end = std::min(queries.size(), start + m_parse_batch_size);
+        {
+          std::unique_lock<std::mutex> lk(mutex);
+          cv_space.wait(lk, [&]() { return end - delivered <= window; });
+        }
+
+        std::vector<std::string>         batch(queries.begin() + start, queries.begin() + end);
+        std::vector<ParsedQuery>         parsed;
+        std::vector<Postal::ParseResult> nonorm;
+        bool                             ok = m_postal.parse_batch(batch, parsed, nonorm);
+
+        {
+          std::lock_guard<std::mutex> lk(mutex);
+          if (!ok)
+            parsing_ok = false;
+          for (size_t i = 0; i < batch.size(); ++i)
+            queue.push_back(Item{ start + i, ok, std::move(parsed[i]) });
+        }
+        cv_parsed.notify_all();
+      }
+
+    std::lock_guard<std::mutex> lk(mutex);
+    parsing_done = true;
+    cv_parsed.notify_all();
+  };
+
+  // search stage
+  auto search = [&](Geocoder *geocoder) {
+    while (true)
+      {
+        Item item;
+        {
+          std::unique_lock<std::mutex> lk(mutex);
+          cv_parsed.wait(lk, [&]() { return parsing_done || !queue.empty(); });
+          if (queue.empty())
+            return;
+          item = std::move(queue.front());
+          queue.pop_front();
+        }
+
+        std::vector<Geocoder::GeoResult> result;
+        if (item.ok)
+          geocoder->search(item.parsed, result, min_levels, reference, viewport);
+
+        {
+          std::lock_guard<std::mutex> lk(mutex);
+          done[item.index] = std::move(result);
+        }
+
+        // deliver all results that are next in order
+        std::lock_guard<std::mutex> dl(deliver_mutex);
+        while (true)
+          {
+            size_t index;
+            {
+              std::lock_guard<std::mutex> lk(mutex);
+              auto                        d = done.find(delivered);
+              if (d == done.end())
+                break;
+              index  = delivered;
+              result = std::move(d->second);
+              done.erase(d);
+            }
+
+            callback(index, result);
+
+            {
+              std::lock_guard<std::mutex> lk(mutex);
+              ++delivered;
+            }
+            cv_space.notify_all();
+          }
+      }
+  };
+
+  std::thread              parser(parse);
+  std::vector<std::thread> searchers;
+  for (Geocoder *g : m_geocoders)
+    searchers.push_back(std::thread(search, g));
+
+  parser.join();
+  for (std::thread &t : searchers)
+    t.join();
+
+  return parsing_ok;
+}
+
+bool BatchGeocoder::run(const std::vector<std::string>                 &queries,
+                        std::vector<std::vector<Geocoder::GeoResult> > &results,
+                        size_t min_levels, const Geocoder::GeoReference &reference,
+                        const BoundingBox &viewport)
+{
+  results.clear();
+  results.resize(queries.size());
+  return run(
+      queries,
+      [&results](size_t index, std::vector<Geocoder::GeoResult> &result) {
+        results[index].swap(result);
+      },
+      min_levels, reference, viewport);
+}
@@ -0,0 +1,71 @@
+#ifndef GEOCODER_BATCHGEOCODER_H
+#define GEOCODER_BATCHGEOCODER_H
+
+#include "geocoder.h"
+#include "geometry.h"
+#include "postal.h"
+
+#include <algorithm>
+#include <functional>
+#include <string>
+#include <vector>
+
+namespace GeoNLP
+{
+
+/// \brief Geocoding of many queries with parsing and search running concurrently
+///
+/// Queries are parsed by Postal in batches in one thread and passed
+/// through a bounded queue to the search threads, one thread for
+/// each added Geocoder. The geocoders can be opened on the same
+/// database. While the queries are searched, the next ones are
+/// parsed, so the throughput is limited by the slower of the two
+/// stages.
+///
+/// Parser stops when the number of queries that have been parsed,
+/// but not delivered yet, reaches the queue size. Results are
+/// delivered in the order of the queries.
+class BatchGeocoder
+{
+public:
+  typedef std::function<void(size_t index, std::vector<Geocoder::GeoResult> &result)> Callback;
+
+public:
+  BatchGeocoder(Postal &postal) : m_postal(postal) {}
+
+  /// \brief Add geocoder used by one of the search threads
+  void add_geocoder(Geocoder &geocoder) { m_geocoders.push_back(&geocoder); }
+
+  /// \brief Number of queries parsed by Postal in one call
+  size_t get_parse_batch_size() const { return m_parse_batch_size; }
+  void   set_parse_batch_size(size_t sz) { m_parse_batch_size = std::max(sz, (size_t)1); }
+
+  /// \brief Maximal number of queries that are parsed, but not delivered yet
+  size_t get_queue_size() const { return m_queue_size; }
+  void   set_queue_size(size_t sz) { m_queue_size = std::max(sz, (size_t)1); }
+
+  /// \brief Parse and search the queries, results are passed to the callback
+  ///
+  /// Callback is called in the order of the queries, from the search
+  /// threads, one call at a time. Returns false if parsing failed.
+  bool run(const std::vector<std::string> &queries, Callback callback, size_t min_levels = 0,
+           const Geocoder::GeoReference &reference = Geocoder::GeoReference(),
+           const BoundingBox            &viewport  = BoundingBox());
+
+  /// \brief Parse and search the queries, results are given in the order of the queries
+  bool run(const std::vector<std::string> &queries,
+           std::vector<std::vector<Geocoder::GeoResult> > &results, size_t min_levels = 0,
+           const Geocoder::GeoReference &reference = Geocoder::GeoReference(),
+           const BoundingBox            &viewport  = BoundingBox());
+
+protected:
+  Postal                 &m_postal;
+  std::vector<Geocoder *> m_geocoders;
+
+  size_t m_parse_batch_size = 16;
+  size_t m_queue_size       = 64;
+};
+
+}
+
+#endif // GEOCODER_BATCHGEOCODER_H
@@ -0,0 +1,249 @@
+#include "corridor.h"
+
+#include <deque>
+#include <utility>
+
+using namespace GeoNLP;
+
+// smallest grid cell size in meters. smaller cells would lead to
+// registration of segments in too many cells
+const double corridor_min_cell_size = 100;
+
+// number of cells that are checked before assuming that the box
+// intersects with the corridor
+const size_t corridor_max_cells_check = 4096;
+
+Corridor::Corridor(const std::vector<double> &latitude, const std::vector<double> &longitude,
+                   double radius, size_t skip_points)
+    : m_radius(radius), m_tolerance(std::max(radius, 10.0)), m_skip(skip_points),
+      m_latitude(latitude), m_longitude(longitude), m_line(latitude, longitude, skip_points)
+{
+  if (radius < 0 || latitude.size() < 2 || latitude.size() != longitude.size()
+      || skip_points + 1 >= latitude.size())
+    return;
+
+  simplify();
+  build_grid();
+
+  m_valid = true;
+}
+
+void Corridor::simplify()
+{
+  // Douglas-Peucker simplification with the segments stack instead
+  // of recursion to support long lines
+  const size_t      last = m_latitude.size() - 1;
+  std::vector<bool> keep(m_latitude.size(), false);
+  keep[m_skip] = keep[last] = true;
+
+  std::deque<std::pair<size_t, size_t> > stack;
+  stack.push_back(std::make_pair(m_skip, last));
+  while (!stack.empty())
+    {
+      const size_t a = stack.back().first;
+      const size_t b = stack.back().second;
+      stack.pop_back();
+      if (b <= a + 1)
+        continue;
+
+      const double dist_per_degree_lat = distance_per_latitude();
+      const double dist_per_degree_lon = distance_per_longitude(m_latitude[a]);
+      const double px                  = (m_latitude[b] - m_latitude[a]) * dist_per_degree_lat;
+      const double py                  = (m_longitude[b] - m_longitude[a]) * dist_per_degree_lon;
+      const double nrm2                = px * px + py * py;
+
+      size_t farthest = a;
+      double maxd2    = -1;
+      for (size_t i = a + 1; i < b; ++i)
+        {
+          const double xp = (m_latitude[i] - m_latitude[a]) * dist_per_degree_lat;
+          const double yp = (m_longitude[i] - m_longitude[a]) * dist_per_degree_lon;
+          double       u  = nrm2 > 0 ? (xp * px + yp * py) / nrm2 : 0;
+          u               = std::max(0.0, std::min(1.0, u));
+          const double dx = u * px - xp;
+          const double dy = u * py - yp;
+          const double dd = dx * dx + dy * dy;
+          if (dd > maxd2)
+            {
+              maxd2    = dd;
+              farthest = i;
+            }
+        }
+
+      if (maxd2 > m_tolerance * m_tolerance)
+        {
+          keep[farthest] = true;
+          stack.push_back(std::make_pair(a, farthest));
+          stack.push_back(std::make_pair(farthest, b));
+        }
+    }
+
+  m_simple.clear();
+  for (size_t i = m_skip; i <= last; ++i)
+    if (keep[i])
+      m_simple.push_back(i);
+}
+
+int64_t Corridor::cell_x(double latitude) const
+{
+  return (int64_t)floor(latitude / m_cell_lat);
+}
+
+int64_t Corridor::cell_y(double longitude) const
+{
+  return (int64_t)floor(longitude / m_cell_lon);
+}
+
+uint64_t Corridor::cell_key(int64_t x, int64_t y) const
+{
+  return (((uint64_t)(uint32_t)x) << 32) | (uint64_t)(uint32_t)y;
+}
+
+void Corridor::build_grid()
+{
+  const double reach     = m_radius + m_tolerance;
+  const double cell_size = std::max(2 * reach, corridor_min_cell_size);
+
+  // cell size in longitude is set to be at least cell_size meters
+  // at any latitude of the line
+  double maxlat = 0;
+  for (size_t i = m_skip; i < m_latitude.size(); ++i)
+    maxlat = std::max(maxlat, std::fabs(m_latitude[i]));
+
+  m_cell_lat = cell_size / distance_per_latitude();
+  m_cell_lon = cell_size / distance_per_longitude(maxlat);
+
+  // register simplified segments in all cells that are within reach
+  // from the segment. for that, segment is sampled and the cells
+  // around the samples are registered
+  const double step = cell_size / 2;
+  const double half = reach + step / 2;
+  for (size_t k = 0; k + 1 < m_simple.size(); ++k)
+    {
+      const size_t a = m_simple[k];
+      const size_t b = m_simple[k + 1];
+
+      const double dist_per_degree_lat = distance_per_latitude();
+      const double dist_per_degree_lon = distance_per_longitude(m_latitude[a]);
+      const double dlat                = m_latitude[b] - m_latitude[a];
+      const double dlon                = m_longitude[b] - m_longitude[a];
+      const double dx                  = dlat * dist_per_degree_lat;
+      const double dy                  = dlon * dist_per_degree_lon;
+      const size_t nsteps              = (size_t)ceil(sqrt(dx * dx + dy * dy) / step);
+
+      for (size_t t = 0; t <= nsteps; ++t)
+        {
+          const double f    = nsteps > 0 ? (double)t / nsteps : 0;
+          const double lat  = m_latitude[a] + f * dlat;
+          const double lon  = m_longitude[a] + f * dlon;
+          const double hlat = half / dist_per_degree_lat;
+          const double hlon = half / distance_per_longitude(lat);
+
+          const int64_t x1 = cell_x(lat + hlat);
+          const int64_t y1 = cell_y(lon + hlon);
+          for (int64_t x = cell_x(lat - hlat); x <= x1; ++x)
+            for (int64_t y = cell_y(lon - hlon); y <= y1; ++y)
+              {
+                std::vector<uint32_t> &segments = m_grid[cell_key(x, y)];
+                if (segments.empty() || segments.back() != k)
+                  segments.push_back(k);
+              }
+        }
+    }
+}
+
+std::vector<BoundingBox> Corridor::boxes(double max_size, size_t seg0, size_t seg1) const
+{
+  std::vector<BoundingBox> result;
+  if (!m_valid)
+    return result;
+
+  const double reach = m_radius + m_tolerance;
+  max_size           = std::max(max_size, corridor_min_cell_size);
+
+  BoundingBox current;
+  for (size_t k = 0; k + 1 < m_simple.size(); ++k)
+    {
+      const size_t a = m_simple[k];
+      const size_t b = m_simple[k + 1];
+      if (b <= seg0 || a >= seg1)
+        continue;
+
+      // split long segments into pieces that are smaller than max_size
+      const double dist_per_degree_lat = distance_per_latitude();
+      const double dist_per_degree_lon = distance_per_longitude(m_latitude[a]);
+      const double dlat                = m_latitude[b] - m_latitude[a];
+      const double dlon                = m_longitude[b] - m_longitude[a];
+      const size_t npieces             = std::max(
+          (size_t)1, (size_t)ceil(std::max(std::fabs(dlat) * dist_per_degree_lat,
+                                           std::fabs(dlon) * dist_per_degree_lon)
+                                  / max_size));
+
+      for (size_t t = 0; t < npieces; ++t)
+        {
+          BoundingBox piece;
+          piece.add(m_latitude[a] + dlat * t / npieces, m_longitude[a] + dlon * t / npieces);
+          piece.add(m_latitude[a] + dlat * (t + 1) / npieces,
+                    m_longitude[a] + dlon * (t + 1) / npieces);
+
+          BoundingBox merged = current;
+          merged.add(piece);
+          if (!current.empty()
+              && ((merged.max_latitude - merged.min_latitude) * dist_per_degree_lat > max_size
+                  || (merged.max_longitude - merged.min_longitude) * dist_per_degree_lon
+                         > max_size))
+            {
+              result.push_back(current.expanded(reach));
+              current = piece;
+            }
+          else
+            current = merged;
+        }
+    }
+
+  if (!current.empty())
+    result.push_back(current.expanded(reach));
+
+  return result;
+}
+
+bool Corridor::intersects(const BoundingBox &box) const
+{
+  if (!m_valid || box.empty())
+    return false;
+
+  const int64_t x0 = cell_x(box.min_latitude);
+  const int64_t x1 = cell_x(box.max_latitude);
+  const int64_t y0 = cell_y(box.min_longitude);
+  const int64_t y1 = cell_y(box.max_longitude);
+  if ((size_t)((x1 - x0 + 1) * (y1 - y0 + 1)) > corridor_max_cells_check)
+    return true;
+
+  for (int64_t x = x0; x <= x1; ++x)
+    for (int64_t y = y0; y <= y1; ++y)
+      if (m_grid.count(cell_key(x, y)))
+        return true;
+
+  return false;
+}
+
+bool Corridor::match(double latitude, double longitude, Match &m, size_t seg0) const
+{
+  if (!m_valid)
+    return false;
+
+  auto cell = m_grid.find(cell_key(cell_x(latitude), cell_y(longitude)));
+  if (cell == m_grid.end())
+    return false;
+
+  // simplified segments are registered in the order along the line
+  // and cover consecutive ranges of the original segments. so, the
+  // first found segment is the first one along the line
+  for (uint32_t k : cell->second)
+    if (m_simple[k + 1] > seg0
+        && m_line.first_within(latitude, longitude, m_radius, m, std::max(m_simple[k], seg0),
+                               m_simple[k + 1]))
+      return true;
+
+  return false;
+}
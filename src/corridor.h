@@ -0,0 +1,97 @@
+#ifndef GEOCODER_CORRIDOR_H
+#define GEOCODER_CORRIDOR_H
+
+#include "geometry.h"
+#include "polyline.h"
+
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+
+namespace GeoNLP
+{
+
+/// \brief Spatial index of the area within given distance from a linestring
+///
+/// Corridor is used for searching objects next to the route. On
+/// construction, the linestring is simplified within a tolerance and
+/// the simplified segments are registered in a uniform grid with the
+/// cells of the size comparable to the search radius. As a result,
+/// the distance of an object to the route is found by checking only
+/// the segments that are registered at the object's grid cell.
+///
+/// Distances are calculated by Polyline using the earth as a plane
+/// approximation around each segment of the line.
+class Corridor
+{
+public:
+  /// first segment of the line within radius from the point
+  typedef Polyline::Projection Match;
+
+public:
+  /// \brief Construct corridor with the radius given in meters
+  ///
+  /// Parameter skip_points can be used to skip the given number of
+  /// points from the beginning of the line. Segment indexes and
+  /// offsets are given relative to the full line, with the offset
+  /// measured from the first point that is not skipped.
+  Corridor(const std::vector<double> &latitude, const std::vector<double> &longitude,
+           double radius, size_t skip_points = 0);
+
+  operator bool() const { return m_valid; }
+
+  double radius() const { return m_radius; }
+  double length() const { return m_line.length(); }
+
+  /// \brief Projected line used for distance calculations
+  const Polyline &line() const { return m_line; }
+
+  /// \brief Number of segments in the simplified line
+  size_t simplified_size() const { return m_simple.empty() ? 0 : m_simple.size() - 1; }
+
+  /// \brief Bounding boxes covering the corridor
+  ///
+  /// Consecutive segments are merged into the same box while the box
+  /// is smaller than max_size (meters) in each direction. Boxes are
+  /// expanded by the radius and can be used to query the spatial
+  /// index. Boxes can be limited to cover only segments [seg0, seg1)
+  /// of the original line.
+  std::vector<BoundingBox> boxes(double max_size = 2000, size_t seg0 = 0,
+                                 size_t seg1 = Polyline::npos) const;
+
+  /// \brief Check whether the box overlaps with the grid cells occupied by the corridor
+  bool intersects(const BoundingBox &box) const;
+
+  /// \brief Find the first segment of the line within radius from the point
+  ///
+  /// Only segments starting from seg0 are considered.
+  bool match(double latitude, double longitude, Match &m, size_t seg0 = 0) const;
+
+protected:
+  void simplify();
+  void build_grid();
+
+  int64_t  cell_x(double latitude) const;
+  int64_t  cell_y(double longitude) const;
+  uint64_t cell_key(int64_t x, int64_t y) const;
+
+protected:
+  bool   m_valid = false;
+  double m_radius;
+  double m_tolerance;
+  size_t m_skip;
+
+  std::vector<double> m_latitude;
+  std::vector<double> m_longitude;
+
+  Polyline            m_line;
+  std::vector<size_t> m_simple; ///< original indexes of points in the simplified line
+
+  double m_cell_lat;
+  double m_cell_lon;
+  std::unordered_map<uint64_t, std::vector<uint32_t> > m_grid;
+};
+
+}
+
+#endif // GEOCODER_CORRIDOR_H
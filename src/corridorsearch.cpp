@@ -0,0 +1,229 @@
+#include "corridorsearch.h"
+
+#include <deque>
+#include <iostream>
+#include <sstream>
+
+using namespace GeoNLP;
+
+// size of corridor boxes and the smallest size of spatial cells
+// queried from the database, meters
+const double corridor_box_size  = 2000;
+const double corridor_cell_size = 500;
+
+CorridorSearch::CorridorSearch(Geocoder &geocoder, Postal &postal)
+    : m_geocoder(geocoder), m_postal(postal)
+{
+}
+
+bool CorridorSearch::set_route(const std::vector<double> &latitude,
+                               const std::vector<double> &longitude, double radius)
+{
+  m_corridor.reset(new Corridor(latitude, longitude, radius));
+  m_level = SpatialCell::level(std::max(corridor_cell_size, 2 * radius));
+  reset();
+  return *m_corridor;
+}
+
+void CorridorSearch::set_query(const std::vector<std::string> &name_query,
+                               const std::vector<std::string> &type_query)
+{
+  m_name_query = name_query;
+  m_type_query = type_query;
+  reset();
+}
+
+void CorridorSearch::reset()
+{
+  m_position = 0;
+  m_searched = 0;
+  m_processed_cells.clear();
+  m_pending.clear();
+  m_active.clear();
+}
+
+bool CorridorSearch::advance(size_t skip_points, std::vector<Geocoder::GeoResult> &added,
+                             std::vector<Geocoder::GeoResult> &passed)
+{
+  if (!m_corridor || !*m_corridor)
+    return false;
+
+  Geocoder::IndexLock lock(m_geocoder);
+  if (!lock)
+    return false;
+
+  const Polyline &line = m_corridor->line();
+
+  // found objects and processed cells are specific to the database
+  if (skip_points < m_position || m_index.expired() || m_index.lock() != m_geocoder.m_index)
+    reset();
+  m_index = m_geocoder.m_index;
+  m_position = skip_points;
+
+  const double offset  = skip_points < line.last() ? line.offset(skip_points) : line.length();
+  const double horizon = m_lookahead < 0 ? line.length() : offset + m_lookahead;
+
+  // drop objects that are behind the current position
+  for (auto a = m_active.begin(); a != m_active.end() && a->first < offset;)
+    {
+      Geocoder::GeoResult r = a->second;
+      r.distance            = a->first - offset;
+      passed.push_back(r);
+      a = m_active.erase(a);
+    }
+
+  m_pending.erase(m_pending.begin(), m_pending.lower_bound(offset));
+
+  try
+    {
+      // search segments that have entered the lookahead distance
+      size_t seg0 = std::max(m_searched, skip_points);
+      size_t seg1 = seg0;
+      while (seg1 < line.last() && line.offset(seg1) <= horizon)
+        ++seg1;
+
+      if (seg0 < seg1)
+        {
+          search_segments(seg0, seg1);
+          m_searched = seg1;
+        }
+
+      // report new objects in the order along the route
+      const size_t max_results = m_geocoder.get_max_results();
+      auto         p           = m_pending.begin();
+      while (p != m_pending.end() && p->first <= horizon
+             && (max_results == 0 || m_active.size() < max_results))
+        {
+          const Candidate &c = p->second;
+          if (!check_name(c))
+            {
+              p = m_pending.erase(p);
+              continue;
+            }
+
+          Geocoder::GeoResult r;
+          r.id = c.id;
+
+          m_geocoder.get_name(r.id, r.title, r.address, r.admin_levels,
+                              m_geocoder.get_levels_in_title());
+          r.type = m_geocoder.get_type(r.id);
+          m_geocoder.get_features(r);
+
+          r.latitude        = c.latitude;
+          r.longitude       = c.longitude;
+          r.search_rank     = c.search_rank;
+          r.levels_resolved = 1; // not used in this search
+
+          m_active.insert(std::make_pair(p->first, r));
+
+          r.distance = p->first - offset;
+          added.push_back(r);
+
+          p = m_pending.erase(p);
+        }
+    }
+  catch (sqlite3pp::database_error &e)
+    {
+      std::cerr << "Geocoder exception: " << e.what() << std::endl;
+      return false;
+    }
+
+  return true;
+}
+
+void CorridorSearch::upcoming(std::vector<Geocoder::GeoResult> &result) const
+{
+  if (!m_corridor || !*m_corridor)
+    return;
+
+  const Polyline &line   = m_corridor->line();
+  const double    offset = m_position < line.last() ? line.offset(m_position) : line.length();
+  for (const auto &a : m_active)
+    {
+      Geocoder::GeoResult r = a.second;
+      r.distance            = a.first - offset;
+      result.push_back(r);
+    }
+}
+
+void CorridorSearch::search_segments(size_t seg0, size_t seg1)
+{
+  sqlite3pp::database &db = m_geocoder.m_index->db;
+
+  // step 1: get cells that are near the segments
+  std::vector<SpatialCell::Range> ranges;
+  for (const BoundingBox &bbox : m_corridor->boxes(corridor_box_size, seg0, seg1))
+    for (uint64_t cell : SpatialCell::cells(bbox, m_level))
+      {
+        if (m_processed_cells.count(cell))
+          continue;
+        m_processed_cells.insert(cell);
+        if (m_corridor->intersects(SpatialCell::bounds(cell, m_level)))
+          ranges.push_back(SpatialCell::range(cell, m_level));
+      }
+
+  SpatialCell::merge(ranges);
+
+  // step 2: get objects from new cells that are next to the route
+  const size_t ranges_per_query = 100;
+  for (size_t range_start = 0; range_start < ranges.size(); range_start += ranges_per_query)
+    {
+      std::ostringstream qtxt;
+      qtxt << "SELECT o.id, o.name, o.name_extra, o.name_en, "
+           << "o.latitude, o.longitude, o.search_rank "
+           << "FROM object_primary o "
+           << "JOIN type t ON o.type_id=t.id "
+           << "WHERE ";
+
+      if (!m_type_query.empty())
+        {
+          std::string tqfull;
+          for (auto tq : m_type_query)
+            {
+              if (!tqfull.empty())
+                tqfull += " OR ";
+              else
+                tqfull = "(";
+              tqfull += " t.name = '" + tq + "'";
+            }
+          qtxt << tqfull << ") AND ";
+        }
+
+      const size_t range_end = std::min(ranges.size(), range_start + ranges_per_query);
+      qtxt << Geocoder::cell_condition(std::vector<SpatialCell::Range>(
+          ranges.begin() + range_start, ranges.begin() + range_end));
+#ifdef GEONLP_PRINT_SQL
+      std::cout << qtxt.str() << "\n";
+#endif
+      sqlite3pp::query qry(db, qtxt.str().c_str());
+
+      for (auto v : qry)
+        {
+          Candidate   c;
+          char const *name, *name_extra, *name_en;
+          v.getter() >> c.id >> name >> name_extra >> name_en >> c.latitude >> c.longitude
+              >> c.search_rank;
+
+          // only upcoming part of the route is considered
+          if (!m_corridor->match(c.latitude, c.longitude, c.match, m_position))
+            continue;
+
+          c.name       = (name ? name : "");
+          c.name_extra = (name_extra ? name_extra : "");
+          c.name_en    = (name_en ? name_en : "");
+          m_pending.insert(std::make_pair(c.match.offset, c));
+        }
+    }
+}
+
+bool CorridorSearch::check_name(const Candidate &c)
+{
+  if (m_name_query.empty())
+    return true;
+
+  std::set<std::string> names;
+  names.insert(c.name);
+  names.insert(c.name_extra);
+  names.insert(c.name_en);
+  return Geocoder::name_matches(m_name_query, names, m_postal);
+}
@@ -0,0 +1,106 @@
+#ifndef GEOCODER_CORRIDORSEARCH_H
+#define GEOCODER_CORRIDORSEARCH_H
+
+#include "corridor.h"
+#include "geocoder.h"
+#include "postal.h"
+
+#include <map>
+#include <memory>
+#include <set>
+#include <string>
+#include <vector>
+
+namespace GeoNLP
+{
+
+/// \brief Search for objects next to the route while moving along it
+///
+/// CorridorSearch keeps the state of the search between the calls:
+/// processed spatial cells, found objects and their
+/// distances along the route. As the position is advanced along the
+/// route, only the segments of the route that entered the lookahead
+/// distance are searched and only the changes in the list of upcoming
+/// objects are reported.
+///
+/// Query is given by name and type, as in Geocoder::search_nearby.
+class CorridorSearch
+{
+public:
+  CorridorSearch(Geocoder &geocoder, Postal &postal);
+
+  /// \brief Set the route and the search radius in meters
+  ///
+  /// Route is given by latitude and longitude vectors (WGS 84). The
+  /// search is reset.
+  bool set_route(const std::vector<double> &latitude, const std::vector<double> &longitude,
+                 double radius);
+
+  /// \brief Set name and type queries, the search is reset
+  void set_query(const std::vector<std::string> &name_query,
+                 const std::vector<std::string> &type_query);
+
+  /// \brief Distance in meters along the route ahead of the current position that is searched
+  ///
+  /// Negative value is used to search along the whole route.
+  double get_lookahead() const { return m_lookahead; }
+  void   set_lookahead(double lookahead) { m_lookahead = lookahead; }
+
+  /// \brief Move the current position to the given point of the route
+  ///
+  /// Objects that are within lookahead distance are appended to
+  /// `added` and the objects that are behind the current position
+  /// are appended to `passed`. Distances are given along the route
+  /// starting from the current position. Number of upcoming objects
+  /// is limited by Geocoder maximal number of results.
+  ///
+  /// Moving back along the route or a reload of the database resets
+  /// the search.
+  bool advance(size_t skip_points, std::vector<Geocoder::GeoResult> &added,
+               std::vector<Geocoder::GeoResult> &passed);
+
+  /// \brief Upcoming objects with the distances from the current position
+  void upcoming(std::vector<Geocoder::GeoResult> &result) const;
+
+  /// \brief Forget all found objects and processed cells
+  void reset();
+
+protected:
+  // help structure keeping objects found next to the route before
+  // they are checked against name query
+  struct Candidate
+  {
+    long long       id;
+    std::string     name, name_extra, name_en;
+    double          latitude, longitude;
+    int             search_rank;
+    Corridor::Match match;
+  };
+
+  void search_segments(size_t seg0, size_t seg1);
+  bool check_name(const Candidate &c);
+
+protected:
+  Geocoder &m_geocoder;
+  Postal   &m_postal;
+
+  std::vector<std::string> m_name_query;
+  std::vector<std::string> m_type_query;
+
+  std::unique_ptr<Corridor> m_corridor;
+
+  double m_lookahead = 5000;
+  int    m_level     = 0; ///< level of spatial cells used in search
+  size_t m_position  = 0; ///< current point on the route
+  size_t m_searched  = 0; ///< first segment that has not been searched yet
+
+  std::weak_ptr<Geocoder::Index> m_index; ///< database used to find the objects
+
+  std::set<uint64_t>                         m_processed_cells;
+  std::multimap<double, Candidate>           m_pending; ///< found, but not reported yet
+  std::multimap<double, Geocoder::GeoResult> m_active;  ///< reported as upcoming
+};
+
+}
+
+#endif // GEOCODER_CORRIDORSEARCH_H
@@ -0,0 +1,84 @@
+#include "expansioncache.h"
+
+using namespace GeoNLP;
+
+std::string ExpansionCache::make_key(const std::string              &input,
+                                     const std::vector<std::string> &languages)
+{
+  // languages are separated from the input by the character that
+  // cannot appear in the normalized input
+  std::string key = input;
+  for (const std::string &l : languages)
+    {
+      key.push_back('\0');
+      key += l;
+    }
+  return key;
+}
+
+bool ExpansionCache::get(const std::string &key, std::vector<std::string> &expansions)
+{
+  auto it = m_index.find(key);
+  if (it == m_index.end())
+    {
+      ++m_misses;
+      return false;
+    }
+
+  ++m_hits;
+  m_entries.splice(m_entries.begin(), m_entries, it->second);
+  expansions.insert(expansions.end(), it->second->second.begin(), it->second->second.end());
+  return true;
+}
+
+void ExpansionCache::put(const std::string &key, const std::vector<std::string> &expansions)
+{
+  if (m_capacity == 0)
+    return;
+
+  auto it = m_index.find(key);
+  if (it != m_index.end())
+    {
+      m_memory -= entry_memory(*it->second);
+      m_entries.erase(it->second);
+      m_index.erase(it);
+    }
+
+  m_entries.push_front(std::make_pair(key, expansions));
+  m_index[key] = m_entries.begin();
+  m_memory += entry_memory(m_entries.front());
+  evict();
+}
+
+void ExpansionCache::clear()
+{
+  m_entries.clear();
+  m_index.clear();
+  m_memory = 0;
+}
+
+void ExpansionCache::set_capacity(size_t capacity)
+{
+  m_capacity = capacity;
+  evict();
+}
+
+size_t ExpansionCache::entry_memory(const Entry &e)
+{
+  // key is stored twice: in the list and in the index
+  size_t m = 2 * (sizeof(std::string) + e.first.capacity()) + sizeof(Entry)
+             + 4 * sizeof(void *);
+  for (const std::string &s : e.second)
+    m += sizeof(std::string) + s.capacity();
+  return m;
+}
+
+void ExpansionCache::evict()
+{
+  while (!m_entries.empty() && m_memory > m_capacity)
+    {
+      m_memory -= entry_memory(m_entries.back());
+      m_index.erase(m_entries.back().first);
+      m_entries.pop_back();
+    }
+}
@@ -0,0 +1,60 @@
+#ifndef GEOCODER_EXPANSIONCACHE_H
+#define GEOCODER_EXPANSIONCACHE_H
+
+#include <cstddef>
+#include <list>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace GeoNLP
+{
+
+/// \brief LRU cache of string expansions
+///
+/// Cache is keyed by the input string and the languages used for
+/// expansion. Memory used by the cache is estimated from the sizes
+/// of the stored strings and is limited by the given capacity.
+class ExpansionCache
+{
+public:
+  ExpansionCache(size_t capacity = 8 * 1024 * 1024) : m_capacity(capacity) {}
+
+  /// \brief Find expansions and append them to the result
+  bool get(const std::string &key, std::vector<std::string> &expansions);
+
+  void put(const std::string &key, const std::vector<std::string> &expansions);
+
+  void clear();
+
+  /// \brief Capacity in bytes, zero disables caching
+  size_t get_capacity() const { return m_capacity; }
+  void   set_capacity(size_t capacity);
+
+  size_t memory() const { return m_memory; }
+  size_t size() const { return m_entries.size(); }
+  size_t hits() const { return m_hits; }
+  size_t misses() const { return m_misses; }
+
+  static std::string make_key(const std::string &input, const std::vector<std::string> &languages);
+
+protected:
+  typedef std::pair<std::string, std::vector<std::string> > Entry;
+
+  static size_t entry_memory(const Entry &e);
+  void          evict();
+
+protected:
+  size_t m_capacity;
+  size_t m_memory = 0;
+  size_t m_hits   = 0;
+  size_t m_misses = 0;
+
+  std::list<Entry>                                            m_entries; ///< most recent first
+  std::unordered_map<std::string, std::list<Entry>::iterator> m_index;
+};
+
+}
+
+#endif // GEOCODER_EXPANSIONCACHE_H
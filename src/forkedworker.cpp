@@ -0,0 +1,397 @@
+#include "forkedworker.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <csignal>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <set>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+using namespace GeoNLP;
+
+// sockets of all running workers and the zygote on the parent
+// side. these are closed in the forked processes, otherwise a worker
+// would not notice when its socket is closed by the parent
+static std::mutex    s_sockets_mutex;
+static std::set<int> s_sockets;
+
+// zygote process used to fork the workers
+static std::mutex s_zygote_mutex;
+static int        s_zygote_socket = -1;
+
+static std::map<std::string, ForkedWorker::Factory> &factories()
+{
+  static std::map<std::string, ForkedWorker::Factory> f;
+  return f;
+}
+
+// serve requests until the parent closes the socket
+static void serve(int fd, ForkedWorker::Handler handler)
+{
+  std::string request;
+  while (ForkedWorker::receive_message(fd, request))
+    if (!ForkedWorker::send_message(fd, handler(request)))
+      break;
+  close(fd);
+  _exit(0);
+}
+
+// send pid of the worker and, if the worker was started, its socket
+static bool send_worker(int fd, pid_t pid, int worker_socket)
+{
+  struct iovec iov;
+  iov.iov_base = &pid;
+  iov.iov_len  = sizeof(pid);
+
+  char          control[CMSG_SPACE(sizeof(int))] = {};
+  struct msghdr msg                              = {};
+  msg.msg_iov                                    = &iov;
+  msg.msg_iovlen                                 = 1;
+  if (worker_socket >= 0)
+    {
+      msg.msg_control    = control;
+      msg.msg_controllen = sizeof(control);
+
+      struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+      cmsg->cmsg_level     = SOL_SOCKET;
+      cmsg->cmsg_type      = SCM_RIGHTS;
+      cmsg->cmsg_len       = CMSG_LEN(sizeof(int));
+      std::memcpy(CMSG_DATA(cmsg), &worker_socket, sizeof(int));
+    }
+
+  ssize_t n;
+  do
+    n = sendmsg(fd, &msg, MSG_NOSIGNAL);
+  while (n < 0 && errno == EINTR);
+  return n == sizeof(pid);
+}
+
+static bool receive_worker(int fd, pid_t &pid, int &worker_socket)
+{
+  struct iovec iov;
+  iov.iov_base = &pid;
+  iov.iov_len  = sizeof(pid);
+
+  char          control[CMSG_SPACE(sizeof(int))] = {};
+  struct msghdr msg                              = {};
+  msg.msg_iov                                    = &iov;
+  msg.msg_iovlen                                 = 1;
+  msg.msg_control                                = control;
+  msg.msg_controllen                             = sizeof(control);
+
+  ssize_t n;
+  do
+    n = recvmsg(fd, &msg, 0);
+  while (n < 0 && errno == EINTR);
+  if (n != sizeof(pid))
+    return false;
+
+  worker_socket        = -1;
+  struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+  if (cmsg && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+    std::memcpy(&worker_socket, CMSG_DATA(cmsg), sizeof(int));
+  return true;
+}
+
+// zygote process: fork workers on request until the parent exits
+static void zygote(int fd)
+{
+  // workers are reaped automatically
+  signal(SIGCHLD, SIG_IGN);
+
+  std::string name, config;
+  while (ForkedWorker::receive_message(fd, name) && ForkedWorker::receive_message(fd, config))
+    {
+      auto  factory = factories().find(name);
+      int   fds[2];
+      pid_t pid = -1;
+      if (factory != factories().end() && socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0)
+        {
+          pid = fork();
+          if (pid == 0)
+            {
+              signal(SIGCHLD, SIG_DFL);
+              close(fd);
+              close(fds[0]);
+              serve(fds[1], factory->second(config));
+            }
+
+          close(fds[1]);
+          if (pid < 0)
+            close(fds[0]);
+        }
+
+      const bool sent = send_worker(fd, pid, pid > 0 ? fds[0] : -1);
+      if (pid > 0)
+        close(fds[0]);
+      if (!sent)
+        break;
+    }
+
+  close(fd);
+  _exit(0);
+}
+
+ForkedWorker::~ForkedWorker()
+{
+  stop();
+}
+
+bool ForkedWorker::register_factory(const std::string &name, Factory factory)
+{
+  factories()[name] = factory;
+  return true;
+}
+
+bool ForkedWorker::start_zygote()
+{
+  std::lock_guard<std::mutex> lkz(s_zygote_mutex);
+  if (s_zygote_socket >= 0)
+    return true;
+
+  int fds[2];
+  if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0)
+    {
+      std::cerr << "ForkedWorker: error creating socket pair\n";
+      return false;
+    }
+
+  std::lock_guard<std::mutex> lk(s_sockets_mutex);
+
+  pid_t pid = fork();
+  if (pid < 0)
+    {
+      std::cerr << "ForkedWorker: error forking zygote process\n";
+      close(fds[0]);
+      close(fds[1]);
+      return false;
+    }
+
+  if (pid == 0)
+    {
+      for (int fd : s_sockets)
+        close(fd);
+      close(fds[0]);
+      zygote(fds[1]);
+    }
+
+  close(fds[1]);
+  s_zygote_socket = fds[0];
+  s_sockets.insert(s_zygote_socket);
+  return true;
+}
+
+void ForkedWorker::attach(pid_t pid, int socket, bool child)
+{
+  std::lock_guard<std::mutex> lk(s_sockets_mutex);
+  m_pid    = pid;
+  m_socket = socket;
+  m_child  = child;
+  s_sockets.insert(m_socket);
+}
+
+bool ForkedWorker::start(Handler handler)
+{
+  stop();
+
+  int fds[2];
+  if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0)
+    {
+      std::cerr << "ForkedWorker: error creating socket pair\n";
+      return false;
+    }
+
+  pid_t pid;
+  {
+    std::lock_guard<std::mutex> lk(s_sockets_mutex);
+
+    pid = fork();
+    if (pid < 0)
+      {
+        std::cerr << "ForkedWorker: error forking worker process\n";
+        close(fds[0]);
+        close(fds[1]);
+        return false;
+      }
+
+    if (pid == 0)
+      {
+        for (int fd : s_sockets)
+          close(fd);
+        close(fds[0]);
+        serve(fds[1], handler);
+      }
+  }
+
+  close(fds[1]);
+  attach(pid, fds[0], true);
+  return true;
+}
+
+bool ForkedWorker::start(const std::string &factory, const std::string &config)
+{
+  stop();
+
+  if (!start_zygote())
+    return false;
+
+  std::lock_guard<std::mutex> lk(s_zygote_mutex);
+  if (s_zygote_socket < 0)
+    return false;
+
+  pid_t pid;
+  int   socket;
+  if (!send_message(s_zygote_socket, factory) || !send_message(s_zygote_socket, config)
+      || !receive_worker(s_zygote_socket, pid, socket))
+    {
+      // zygote is not restarted as the program may have several
+      // threads by now
+      std::cerr << "ForkedWorker: error communicating with zygote process\n";
+      std::lock_guard<std::mutex> lks(s_sockets_mutex);
+      s_sockets.erase(s_zygote_socket);
+      close(s_zygote_socket);
+      s_zygote_socket = -1;
+      return false;
+    }
+
+  if (pid <= 0 || socket < 0)
+    {
+      std::cerr << "ForkedWorker: error starting worker process " << factory << "\n";
+      return false;
+    }
+
+  attach(pid, socket, false);
+  return true;
+}
+
+void ForkedWorker::stop()
+{
+  if (m_socket >= 0)
+    {
+      std::lock_guard<std::mutex> lk(s_sockets_mutex);
+      s_sockets.erase(m_socket);
+      close(m_socket);
+    }
+
+  // workers forked by the zygote are reaped by it
+  if (m_pid > 0 && m_child)
+    waitpid(m_pid, nullptr, 0);
+
+  m_socket = -1;
+  m_pid    = -1;
+  m_child  = false;
+}
+
+bool ForkedWorker::call(const std::string &request, std::string &response)
+{
+  if (!running())
+    return false;
+
+  if (!send_message(m_socket, request) || !receive_message(m_socket, response))
+    {
+      std::cerr << "ForkedWorker: error communicating with worker process " << m_pid << "\n";
+      stop();
+      return false;
+    }
+
+  return true;
+}
+
+bool ForkedWorker::send_message(int fd, const std::string &msg)
+{
+  const uint64_t len = msg.size();
+  std::string    buffer((const char *)&len, sizeof(len));
+  buffer += msg;
+
+  for (size_t done = 0; done < buffer.size();)
+    {
+      ssize_t n = send(fd, buffer.data() + done, buffer.size() - done, MSG_NOSIGNAL);
+      if (n < 0 && errno == EINTR)
+        continue;
+      if (n <= 0)
+        return false;
+      done += n;
+    }
+
+  return true;
+}
+
+static bool receive_all(int fd, char *data, size_t size)
+{
+  for (size_t done = 0; done < size;)
+    {
+      ssize_t n = recv(fd, data + done, size - done, 0);
+      if (n < 0 && errno == EINTR)
+        continue;
+      if (n <= 0)
+        return false;
+      done += n;
+    }
+  return true;
+}
+
+bool ForkedWorker::receive_message(int fd, std::string &msg)
+{
+  uint64_t len;
+  if (!receive_all(fd, (char *)&len, sizeof(len)))
+    return false;
+
+  msg.resize(len);
+  return len == 0 || receive_all(fd, &msg[0], len);
+}
+
+void ForkedWorker::write_size(std::string &buffer, uint64_t v)
+{
+  buffer.append((const char *)&v, sizeof(v));
+}
+
+bool ForkedWorker::read_size(const std::string &buffer, size_t &pos, uint64_t &v)
+{
+  if (pos + sizeof(v) > buffer.size())
+    return false;
+  std::copy(buffer.data() + pos, buffer.data() + pos + sizeof(v), (char *)&v);
+  pos += sizeof(v);
+  return true;
+}
+
+void ForkedWorker::write_string(std::string &buffer, const std::string &s)
+{
+  write_size(buffer, s.size());
+  buffer += s;
+}
+
+bool ForkedWorker::read_string(const std::string &buffer, size_t &pos, std::string &s)
+{
+  uint64_t len;
+  if (!read_size(buffer, pos, len) || pos + len > buffer.size())
+    return false;
+  s.assign(buffer, pos, len);
+  pos += len;
+  return true;
+}
+
+void ForkedWorker::write_strings(std::string &buffer, const std::vector<std::string> &v)
+{
+  write_size(buffer, v.size());
+  for (const std::string &s : v)
+    write_string(buffer, s);
+}
+
+bool ForkedWorker::read_strings(const std::string &buffer, size_t &pos,
+                                std::vector<std::string> &v)
+{
+  uint64_t n;
+  if (!read_size(buffer, pos, n))
+    return false;
+  v.resize(n);
+  for (std::string &s : v)
+    if (!read_string(buffer, pos, s))
+      return false;
+  return true;
+}
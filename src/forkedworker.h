@@ -0,0 +1,103 @@
+#ifndef GEOCODER_FORKEDWORKER_H
+#define GEOCODER_FORKEDWORKER_H
+
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <sys/types.h>
+#include <vector>
+
+namespace GeoNLP
+{
+
+/// \brief Helper process answering requests over a socket
+///
+/// Worker process is forked on start and runs the handler for each
+/// request sent by the parent. Requests and responses are arbitrary
+/// byte strings. The handler is called in the forked process only,
+/// so it can use libraries with global state without affecting the
+/// parent. Worker process exits when the worker is stopped or the
+/// parent exits.
+///
+/// After fork, only async-signal-safe calls are allowed in a child
+/// of a multithreaded process. As handlers allocate memory and load
+/// libraries, workers of multithreaded programs are started from a
+/// zygote: a helper process forked while the program is still
+/// single-threaded. The zygote forks the workers on request and
+/// creates their handlers with the registered factories. Workers
+/// with handlers given directly are forked from the calling process
+/// and can be started only while it has a single thread.
+///
+/// Calls to a single worker should be serialized by the caller.
+class ForkedWorker
+{
+public:
+  typedef std::function<std::string(const std::string &)> Handler;
+  typedef std::function<Handler(const std::string &config)> Factory;
+
+public:
+  ForkedWorker() {}
+  ~ForkedWorker();
+
+  ForkedWorker(const ForkedWorker &) = delete;
+  ForkedWorker &operator=(const ForkedWorker &) = delete;
+
+  /// \brief Fork worker from the calling process
+  ///
+  /// Use only while the calling process has a single thread.
+  bool start(Handler handler);
+
+  /// \brief Fork worker from the zygote
+  ///
+  /// Handler is created in the worker process by the registered
+  /// factory called with the given configuration. Zygote is started
+  /// if needed.
+  bool start(const std::string &factory, const std::string &config);
+
+  void stop();
+
+  bool running() const { return m_socket >= 0; }
+
+  /// \brief Send request and wait for the response
+  ///
+  /// On communication error, the worker is stopped and false is returned.
+  bool call(const std::string &request, std::string &response);
+
+public:
+  /// \brief Register factory of handlers for workers forked by the zygote
+  ///
+  /// Factories have to be registered before the zygote is started,
+  /// usually during static initialization.
+  static bool register_factory(const std::string &name, Factory factory);
+
+  /// \brief Start the zygote used to fork the workers
+  ///
+  /// Call at the start of the program, before any threads are
+  /// created. Zygote exits together with the program.
+  static bool start_zygote();
+
+  // framed messages over socket, used by both sides
+  static bool send_message(int fd, const std::string &msg);
+  static bool receive_message(int fd, std::string &msg);
+
+  // serialization of requests and responses. readers advance the
+  // position in the buffer and return false if the buffer is too short
+  static void write_size(std::string &buffer, uint64_t v);
+  static bool read_size(const std::string &buffer, size_t &pos, uint64_t &v);
+  static void write_string(std::string &buffer, const std::string &s);
+  static bool read_string(const std::string &buffer, size_t &pos, std::string &s);
+  static void write_strings(std::string &buffer, const std::vector<std::string> &v);
+  static bool read_strings(const std::string &buffer, size_t &pos, std::vector<std::string> &v);
+
+protected:
+  void attach(pid_t pid, int socket, bool child);
+
+protected:
+  pid_t m_pid    = -1;
+  int   m_socket = -1;
+  bool  m_child  = false; // forked by this process and has to be waited for
+};
+
+}
+
+#endif // GEOCODER_FORKEDWORKER_H
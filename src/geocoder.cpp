@@ -1,15 +1,22 @@
 #include "geocoder.h"
+#include "corridorsearch.h"
+#include "geometry.h"
+#include "polyline.h"
+#include "spatialcell.h"
 
 #include <algorithm>
 #include <boost/geometry.hpp>
 #include <deque>
+#include <fstream>
 #include <iostream>
+#include <limits>
 #include <set>
 #include <sstream>
+#include <thread>
 
 using namespace GeoNLP;
 
-const int    GeoNLP::Geocoder::version{ 6 };
+const int    GeoNLP::Geocoder::version{ 8 };
 const size_t GeoNLP::Geocoder::num_languages{ 2 }; // 1 (default) + 1 (english)
 
 typedef boost::geometry::model::point<
@@ -17,18 +24,6 @@ typedef boost::geometry::model::point<
              point_t;
 const double earth_radius = 6378e3; // meters
 
-////////////////////
-// helper functions
-
-static double distance_per_latitude()
-{
-  return 111e3;
-}
-static double distance_per_longitude(double latitude)
-{
-  return std::max(1000.0, M_PI / 180.0 * 6378137.0 * cos(latitude * M_PI / 180.0));
-}
-
 ////////////////////
 // GeoReference class
 
@@ -54,12 +49,25 @@ void Geocoder::GeoReference::reset()
 }
 
 double Geocoder::GeoReference::distance(const Geocoder::GeoResult &r) const
+{
+  return distance(r.latitude, r.longitude);
+}
+
+double Geocoder::GeoReference::distance(double latitude, double longitude) const
 {
   point_t ref(m_longitude, m_latitude);
-  point_t q(r.longitude, r.latitude);
+  point_t q(longitude, latitude);
   return boost::geometry::distance(ref, q) * earth_radius;
 }
 
+double Geocoder::GeoReference::distance(const BoundingBox &box) const
+{
+  if (box.empty() || box.contains(m_latitude, m_longitude))
+    return 0;
+  return distance(std::min(std::max(m_latitude, box.min_latitude), box.max_latitude),
+                  std::min(std::max(m_longitude, box.min_longitude), box.max_longitude));
+}
+
 ////////////////////
 // Geocoder class
 
@@ -91,89 +99,376 @@ Geocoder::Geocoder(const std::string &dbname)
 
 bool Geocoder::load(const std::string &dbname)
 {
-  if (dbname == m_database_path && m_database_open)
+  std::shared_ptr<Index> current = std::atomic_load(&m_published);
+  if (current && dbname == current->path)
     return true;
 
-  // clean before loading anything
-  drop();
+  std::shared_ptr<Index> index = open(dbname);
+  if (!index)
+    return false;
+
+  std::atomic_store(&m_published, index);
+  return true;
+}
+
+bool Geocoder::load()
+{
+  return load(get_database_path());
+}
+
+bool Geocoder::reload()
+{
+  std::shared_ptr<Index> index = open(get_database_path());
+  if (!index)
+    return false;
+
+  // open search index before publishing if it was in use, otherwise
+  // the first search after the swap would open it synchronously
+  if (opened_search_index() && !search_index(*index))
+    {
+      std::cerr << "Geocoder: error opening search index of reloaded database\n";
+      return false;
+    }
+
+  std::atomic_store(&m_published, index);
+  return true;
+}
+
+void Geocoder::drop()
+{
+  std::atomic_store(&m_published, std::shared_ptr<Index>());
+}
+
+std::string Geocoder::get_database_path() const
+{
+  std::shared_ptr<Index> index = std::atomic_load(&m_published);
+  return index ? index->path : std::string();
+}
+
+BoundingBox Geocoder::get_bounding_box() const
+{
+  std::shared_ptr<Index> index = std::atomic_load(&m_published);
+  return index ? index->bounding_box : BoundingBox();
+}
+
+std::string Geocoder::get_postal_country_parser() const
+{
+  std::shared_ptr<Index> index = std::atomic_load(&m_published);
+  return index ? index->postal_country_parser : std::string();
+}
+
+Geocoder::MemoryUsage Geocoder::get_memory_usage() const
+{
+  MemoryUsage            usage;
+  std::shared_ptr<Index> index = std::atomic_load(&m_published);
+  if (!index)
+    return usage;
+
+  std::shared_ptr<SearchIndex> search = opened_search_index();
+  if (search)
+    {
+      usage.trie     = search->trie_file ? search->trie_file.resident() : search->trie.io_size();
+      usage.id_index = search->norm_id_file.resident();
+    }
+  usage.primary = index->primary_file.resident();
+  return usage;
+}
+
+bool Geocoder::open_search_index()
+{
+  std::shared_ptr<Index> index = std::atomic_load(&m_published);
+  return index && search_index(*index);
+}
+
+void Geocoder::release_search_index()
+{
+  std::shared_ptr<Index> index = std::atomic_load(&m_published);
+  if (!index)
+    return;
+
+  std::lock_guard<std::mutex> lk(index->search_mutex);
+  index->search.reset();
+}
+
+std::shared_ptr<Geocoder::SearchIndex> Geocoder::opened_search_index() const
+{
+  std::shared_ptr<Index> index = std::atomic_load(&m_published);
+  if (!index)
+    return std::shared_ptr<SearchIndex>();
+
+  std::lock_guard<std::mutex> lk(index->search_mutex);
+  return index->search;
+}
+
+bool Geocoder::save_access_profile(const std::string &fname) const
+{
+  std::shared_ptr<Index> index = std::atomic_load(&m_published);
+  if (!index)
+    return false;
+
+  std::shared_ptr<SearchIndex> search = opened_search_index();
+  MappedFile                   none;
+
+  std::ofstream fout(fname);
+  if (!fout)
+    {
+      std::cerr << "Geocoder: error opening access profile " << fname << " for writing\n";
+      return false;
+    }
+
+  const std::vector<std::pair<std::string, const MappedFile *> > files
+      = { { "primary", &index->primary_file },
+          { "id_index", search ? &search->norm_id_file : &none },
+          { "trie", search ? &search->trie_file : &none } };
+  for (const auto &f : files)
+    for (const auto &r : f.second->resident_ranges())
+      fout << f.first << " " << r.first << " " << r.second << "\n";
+
+  return (bool)fout;
+}
+
+bool Geocoder::warm_up(const std::string &profile, bool background)
+{
+  std::shared_ptr<Index> index = std::atomic_load(&m_published);
+  if (!index)
+    return false;
+
+  // ranges (component, offset, length) to prefetch, zero length
+  // requests the whole file
+  struct Range
+  {
+    std::string component;
+    size_t      offset;
+    size_t      length;
+  };
+
+  std::vector<Range> ranges;
+  if (profile.empty())
+    ranges.push_back({ "trie", 0, 0 });
+  else
+    {
+      std::ifstream fin(profile);
+      if (!fin)
+        {
+          std::cerr << "Geocoder: error opening access profile " << profile << "\n";
+          return false;
+        }
+
+      Range r;
+      while (fin >> r.component >> r.offset >> r.length)
+        if (r.component == "primary" || r.component == "id_index" || r.component == "trie")
+          ranges.push_back(r);
+    }
+
+  // search index is opened if it is needed for warm up, as it was
+  // used in the profiled run. index is captured to keep the files
+  // open while prefetching
+  auto prefetch = [index, ranges]() {
+    std::shared_ptr<SearchIndex> search;
+    {
+      std::lock_guard<std::mutex> lk(index->search_mutex);
+      search = index->search;
+    }
+
+    auto mapped = [&index, &search](const std::string &component) -> const MappedFile * {
+      const MappedFile *f = nullptr;
+      if (component == "primary")
+        f = &index->primary_file;
+      else if (component == "id_index" && search)
+        f = &search->norm_id_file;
+      else if (component == "trie" && search)
+        f = &search->trie_file;
+      return f && *f ? f : nullptr;
+    };
+
+    // request all ranges first to let the kernel read them in
+    // parallel. files that are not mapped are read into the page
+    // cache before the search index is opened from them
+    bool ok          = true;
+    bool need_search = false;
+    for (const Range &r : ranges)
+      {
+        const MappedFile *f = mapped(r.component);
+        if (f)
+          f->prefetch(r.offset, r.length);
+        else if (r.component == "trie" && search)
+          continue; // already loaded into the process memory
+        else if (r.component == "primary")
+          ok = MappedFile::prefetch(name_primary(index->path), r.offset, r.length) && ok;
+        else if (r.component == "id_index")
+          ok = MappedFile::prefetch(name_normalized_id(index->path), r.offset, r.length) && ok;
+        else
+          ok = MappedFile::prefetch(name_normalized_trie(index->path), r.offset, r.length) && ok;
+        need_search = need_search || r.component != "primary";
+      }
+
+    if (need_search && !search)
+      {
+        search = search_index(*index);
+        ok     = search && ok;
+      }
+
+    for (const Range &r : ranges)
+      {
+        const MappedFile *f = mapped(r.component);
+        if (f)
+          f->prefetch(r.offset, r.length, true);
+      }
+
+    return ok;
+  };
+
+  if (!background)
+    return prefetch();
+
+  std::thread(prefetch).detach();
+  return true;
+}
+
+std::shared_ptr<Geocoder::Index> Geocoder::open(const std::string &dbname)
+{
+  std::shared_ptr<Index> index = std::make_shared<Index>();
 
   bool error = false;
   try
     {
-      m_database_path = dbname;
-      if (m_db.connect(name_primary(m_database_path).c_str(), SQLITE_OPEN_READONLY) != SQLITE_OK)
+      index->path = dbname;
+      if (index->db.connect(name_primary(index->path).c_str(), SQLITE_OPEN_READONLY)
+          != SQLITE_OK)
         {
           error = true;
           std::cerr << "Error opening SQLite database\n";
         }
 
-      if (!error && !check_version())
+      if (!error && !check_version(index->db))
         {
           error = true;
         }
 
-      // Limit Kyoto Cabinet caches
-      m_database_norm_id.tune_map(32LL * 1024LL * 1024LL); // 64MB default
-      // m_database_norm_id.tune_page_cache(32LL*1024LL*1024LL); // 64MB default
-
-      if (!error
-          && !m_database_norm_id.open(name_normalized_id(m_database_path).c_str(),
-                                      kyotocabinet::HashDB::OREADER
-                                          | kyotocabinet::HashDB::ONOLOCK))
+      if (!error)
         {
-          error = true;
-          std::cerr << "Error opening IDs database\n";
+          index->bounding_box          = load_bounding_box(index->db);
+          index->postal_country_parser = load_postal_country_parser(index->db);
         }
 
-      if (!error)
-        m_trie_norm.load(
-            name_normalized_trie(m_database_path).c_str()); // throws exception on error
+      // file is mapped only when requested, the whole file may not
+      // fit into the address space on 32-bit systems
+      if (!error && m_primary_residency != ResidencyLoad
+          && !index->primary_file.open(name_primary(index->path)))
+        error = true;
 
-      m_database_open = true;
+      if (!error && m_primary_residency != ResidencyLoad)
+        {
+          std::ostringstream pragma;
+          pragma << "PRAGMA mmap_size=" << index->primary_file.size();
+          index->db.execute(pragma.str().c_str());
+          if (m_primary_residency == ResidencyLock && !index->primary_file.lock())
+            error = true;
+        }
+
+      index->trie_residency     = m_trie_residency;
+      index->id_index_residency = m_id_index_residency;
     }
   catch (sqlite3pp::database_error &e)
     {
       error = true;
       std::cerr << "Geocoder SQLite exception: " << e.what() << std::endl;
     }
+
+  if (error)
+    return std::shared_ptr<Index>();
+  return index;
+}
+
+std::shared_ptr<Geocoder::SearchIndex> Geocoder::search_index(Index &index)
+{
+  std::lock_guard<std::mutex> lk(index.search_mutex);
+  if (index.search)
+    return index.search;
+
+  std::shared_ptr<SearchIndex> search = std::make_shared<SearchIndex>();
+
+  bool error = false;
+  try
+    {
+      // file is mapped only when requested, the whole file may not
+      // fit into the address space on 32-bit systems
+      if (index.id_index_residency != ResidencyLoad
+          && !search->norm_id_file.open(name_normalized_id(index.path)))
+        error = true;
+
+      // Limit Kyoto Cabinet caches unless whole file is mapped
+      if (index.id_index_residency == ResidencyLoad)
+        search->norm_id.tune_map(32LL * 1024LL * 1024LL); // 64MB default
+      else
+        search->norm_id.tune_map(search->norm_id_file.size());
+      // search->norm_id.tune_page_cache(32LL*1024LL*1024LL); // 64MB default
+
+      if (!error
+          && !search->norm_id.open(name_normalized_id(index.path).c_str(),
+                                   kyotocabinet::HashDB::OREADER | kyotocabinet::HashDB::ONOLOCK))
+        {
+          error = true;
+          std::cerr << "Error opening IDs database\n";
+        }
+
+      if (!error && index.id_index_residency == ResidencyLock && !search->norm_id_file.lock())
+        error = true;
+
+      if (!error && index.trie_residency == ResidencyLoad)
+        search->trie.load(name_normalized_trie(index.path).c_str()); // throws exception on error
+      else if (!error)
+        {
+          if (!search->trie_file.open(name_normalized_trie(index.path))
+              || (index.trie_residency == ResidencyLock && !search->trie_file.lock()))
+            error = true;
+          else
+            search->trie.map(search->trie_file.data(),
+                             search->trie_file.size()); // throws exception on error
+        }
+    }
   catch (marisa::Exception &e)
     {
       error = true;
       std::cerr << "Geocoder MARISA exception: " << e.what() << std::endl;
     }
 
-  if (error)
-    drop();
-  return !error;
+  if (!error)
+    index.search = search;
+  return index.search;
 }
 
-bool Geocoder::load()
+Geocoder::IndexLock::IndexLock(Geocoder &geocoder, bool search_index)
+    : m_geocoder(geocoder), m_previous(geocoder.m_index),
+      m_previous_search(geocoder.m_search_index)
 {
-  return load(m_database_path);
+  if (!m_previous)
+    m_geocoder.m_index = std::atomic_load(&m_geocoder.m_published);
+  if (search_index && m_geocoder.m_index && !m_previous_search)
+    m_geocoder.m_search_index = Geocoder::search_index(*m_geocoder.m_index);
+
+  m_ok = m_geocoder.m_index && (!search_index || m_geocoder.m_search_index);
 }
 
-void Geocoder::drop()
+Geocoder::IndexLock::~IndexLock()
 {
-  m_db.disconnect();
-  m_database_norm_id.close();
-  m_trie_norm.clear();
-  m_database_path = std::string();
-  m_database_open = false;
+  m_geocoder.m_index        = m_previous;
+  m_geocoder.m_search_index = m_previous_search;
 }
 
-bool Geocoder::check_version()
+bool Geocoder::check_version(sqlite3pp::database &db)
 {
   std::ostringstream s;
   s << Geocoder::version;
-  return check_version(s.str());
+  return check_version(db, s.str());
 }
 
-bool Geocoder::check_version(const std::string &supported)
+bool Geocoder::check_version(sqlite3pp::database &db, const std::string &supported)
 {
   // this cannot through exceptions
   try
     {
-      sqlite3pp::query qry(m_db, "SELECT value FROM meta WHERE key=\"version\"");
+      sqlite3pp::query qry(db, "SELECT value FROM meta WHERE key=\"version\"");
 
       for (auto v : qry)
         {
@@ -198,13 +493,44 @@ bool Geocoder::check_version(const std::string &supported)
   return false;
 }
 
+BoundingBox Geocoder::load_bounding_box(sqlite3pp::database &db)
+{
+  std::map<std::string, double> values;
+  sqlite3pp::query              qry(db, "SELECT key, value FROM meta WHERE key LIKE \"bbox:%\"");
+  for (auto v : qry)
+    {
+      std::string key;
+      double      value;
+      v.getter() >> key >> value;
+      values[key] = value;
+    }
+
+  if (values.size() != 4)
+    return BoundingBox();
+
+  return BoundingBox(values["bbox:min_latitude"], values["bbox:max_latitude"],
+                    values["bbox:min_longitude"], values["bbox:max_longitude"]);
+}
+
+std::string Geocoder::load_postal_country_parser(sqlite3pp::database &db)
+{
+  sqlite3pp::query qry(db, "SELECT value FROM meta WHERE key=\"postal:country:parser\"");
+  for (auto v : qry)
+    {
+      char const *value;
+      v.getter() >> value;
+      return value ? value : "";
+    }
+  return std::string();
+}
+
 void Geocoder::update_limits()
 {
   m_max_inter_results = m_max_results + m_max_inter_offset;
 }
 
 #ifdef GEONLP_PRINT_DEBUG
-static std::string v2s(const std::vector<std::string> &v)
+static std::string v2s(const ParsedQuery::Expansions &v)
 {
   std::string s = "{";
   for (auto i : v)
@@ -220,19 +546,54 @@ static std::string v2s(const std::vector<std::string> &v)
 
 bool Geocoder::search(const std::vector<Postal::ParseResult> &parsed_query,
                       std::vector<Geocoder::GeoResult> &result, size_t min_levels,
-                      const GeoReference &reference)
+                      const GeoReference &reference, const BoundingBox &viewport)
+{
+  ParsedQuery q;
+  q.from_parse_results(parsed_query);
+  return search(q, result, min_levels, reference, viewport);
+}
+
+bool Geocoder::search(const ParsedQuery &parsed_query, std::vector<Geocoder::GeoResult> &result,
+                      size_t min_levels, const GeoReference &reference,
+                      const BoundingBox &viewport)
 {
-  if (!m_database_open)
+  IndexLock lock(*this, true);
+  if (!lock)
     return false;
 
   // parse query by libpostal
-  std::vector<Postal::Hierarchy> parsed_result;
-  std::string                    postal_code;
+  std::vector<ParsedQuery::Hierarchy> parsed_result;
+  std::string                         postal_code;
 
   Postal::result2hierarchy(parsed_query, parsed_result, postal_code);
 
+  // drop duplicate hierarchies, keeping the first one
+  {
+    std::set<std::string>          seen;
+    std::vector<ParsedQuery::Hierarchy> unique;
+    for (const ParsedQuery::Hierarchy &h : parsed_result)
+      {
+        std::string key;
+        for (const auto &level : h)
+          {
+            key.push_back('\1');
+            for (const std::string &s : level)
+              {
+                key.push_back('\0');
+                key += s;
+              }
+          }
+        if (seen.insert(key).second)
+          unique.push_back(h);
+      }
+    parsed_result.swap(unique);
+  }
+
   result.clear();
+  m_memo.clear();
   m_levels_resolved = min_levels;
+  m_reference       = reference;
+  m_viewport        = viewport;
 
 #ifdef GEONLP_PRINT_DEBUG
   std::cout << "Search hierarchies:\n";
@@ -279,8 +640,8 @@ bool Geocoder::search(const std::vector<Postal::ParseResult> &parsed_query,
           r.type = get_type(r.id);
           get_features(r);
 
-          sqlite3pp::query qry(
-              m_db, "SELECT latitude, longitude, search_rank FROM object_primary WHERE id=?");
+          sqlite3pp::query qry(m_index->db, "SELECT latitude, longitude, search_rank "
+                                            "FROM object_primary WHERE id=?");
           qry.bind(1, r.id);
           for (auto v : qry)
             {
@@ -291,20 +652,20 @@ bool Geocoder::search(const std::vector<Postal::ParseResult> &parsed_query,
 
           if (reference.is_set())
             {
-              r.distance = reference.distance(r);
-
-              // Here, 1000 is used to scale search_rank. Same factor is used in Geocoder importer
-              r.search_rank -= reference.importance() * 1000
-                               * search_rank_location_bias(r.distance, reference.zoom());
+              r.distance    = reference.distance(r);
+              r.search_rank = location_rank(r.search_rank, r.distance);
             }
         }
     }
   catch (sqlite3pp::database_error &e)
     {
+      m_memo.clear();
       std::cerr << "Geocoder exception: " << e.what() << std::endl;
       return false;
     }
 
+  m_memo.clear();
+
   // sort and trim results
   std::sort(result.begin(), result.end());
   if (m_max_results > 0 && result.size() >= m_max_results)
@@ -313,16 +674,17 @@ bool Geocoder::search(const std::vector<Postal::ParseResult> &parsed_query,
   return true;
 }
 
-bool Geocoder::search(const Postal::Hierarchy &parsed, const std::string &postal_code,
+bool Geocoder::search(const ParsedQuery::Hierarchy &parsed, const std::string &postal_code,
                       std::vector<Geocoder::GeoResult> &result, size_t level, long long int range0,
                       long long int range1)
 {
   /// Special case of search made by postal code only
   if (level == 0 && parsed.size() == 0 && !postal_code.empty())
     {
-      std::string      p = postal_code;
-      sqlite3pp::query qry(
-          m_db, "SELECT id FROM object_primary WHERE postal_code=:pcode ORDER BY id ASC");
+      std::string      p    = postal_code;
+      std::string      qtxt = "SELECT o.id FROM object_primary o WHERE o.postal_code=:pcode "
+                              + viewport_condition() + "ORDER BY o.id ASC";
+      sqlite3pp::query qry(m_index->db, qtxt.c_str());
       qry.bind(":pcode", postal_code.c_str(), sqlite3pp::nocopy);
       for (auto v : qry)
         {
@@ -347,158 +709,639 @@ bool Geocoder::search(const Postal::Hierarchy &parsed, const std::string &postal
 
   m_query_count++;
 
+  // the plan is made for the whole hierarchy when starting it
+  if (level == 0)
+    {
+      size_t         start_level = 0;
+      SearchStrategy strategy    = plan(parsed, postal_code, start_level);
+      if (strategy == StrategyMergeJoin)
+        return search_merge_join(parsed, result);
+      if (strategy == StrategyBottomUp
+          && search_bottom_up(parsed, postal_code, result, start_level))
+        return true;
+    }
+
   std::set<long long int>
       ids_explored; /// keeps all ids which have been used to search further at this level
 
-  // help structure keeping marisa-found search string with found ids
-  struct IntermediateResult
-  {
-    std::string    txt;
-    index_id_value id;
-    IntermediateResult(const std::string &t, index_id_value i) : txt(t), id(i) {}
-    bool operator<(const IntermediateResult &A) const
+  std::shared_ptr<const Branches> branches
+      = memo_branches(parsed, level, range0, range1, level == 0);
+  const bool location_aware = m_reference.is_set();
+
+  for (const IntermediateResult &branch : *branches)
     {
-      return (txt.length() < A.txt.length() || (txt.length() == A.txt.length() && txt < A.txt)
-              || (txt == A.txt && id < A.id));
+      if (ids_explored.count(branch.id) > 0)
+        continue; // has been looked into it already
+
+      if (parsed.size() < m_levels_resolved
+          || (parsed.size() == m_levels_resolved && m_max_results > 0
+              && result.size() >= m_max_inter_results
+              && (!location_aware || branch.bound >= worst_location_rank(result))))
+        break; // this search cannot add more or better results
+
+      ids_explored.insert(branch.id);
+      search_branch(parsed, postal_code, result, level, branch);
     }
-  };
 
-  std::deque<IntermediateResult> search_result;
-  for (const std::string &s : parsed[level])
+  return !ids_explored.empty();
+}
+
+void Geocoder::search_branch(const ParsedQuery::Hierarchy &parsed, const std::string &postal_code,
+                             std::vector<GeoResult> &result, size_t level,
+                             const IntermediateResult &branch)
+{
+  const bool    location_aware = m_reference.is_set();
+  const bool    last_level     = (level + 1 >= parsed.size());
+  long long int id             = branch.id;
+  long long int last_subobject = id;
+
+  // if postal code is assigned to this level and is correct,
+  // all subobjects will have the same postal code. check if postal
+  // code is resolved
+  bool postal_is_ok = (postal_code.empty() || memo_postal_code(id) == postal_code);
+
+  // are we interested in this result even if it doesn't have subregions?
+  if (!last_level || !postal_is_ok)
     {
-      marisa::Agent agent;
-      agent.set_query(s.c_str());
-      while (m_trie_norm.predictive_search(agent))
+      last_subobject = memo_last_subobject(id);
+
+      // check if we have results which are better than this one if it
+      // does not have any subobjects
+      if (m_levels_resolved > level + 1 && id >= last_subobject)
+        return; // take the next branch
+    }
+
+  if (last_level || last_subobject <= id
+      || !search(parsed, postal_is_ok ? "" : postal_code, result, level + 1, id + 1,
+                 last_subobject))
+    {
+      // object itself is outside the viewport
+      if (postal_is_ok && !branch.visible)
+        return;
+
+      size_t levels_resolved = level + 1;
+      bool   newlevel        = false;
+      if (m_levels_resolved < levels_resolved)
         {
-          std::string val;
-          if (m_database_norm_id.get(make_id_key(agent.key().id()), &val))
+          result.clear();
+          newlevel = true;
+        }
+
+      if ((m_levels_resolved == levels_resolved || newlevel)
+          && (m_max_results == 0 || result.size() < m_max_inter_results || location_aware))
+        {
+          bool have_already = false;
+          for (const auto &r : result)
+            if (r.id == id)
+              {
+                have_already = true;
+                break;
+              }
+
+          if (!have_already)
             {
-              index_id_value *idx, *idx1;
-              if (get_id_range(val, (level == 0), range0, range1, &idx, &idx1))
+              if (postal_is_ok)
                 {
-                  for (; idx < idx1; ++idx)
+                  GeoResult r;
+                  r.id              = id;
+                  r.levels_resolved = levels_resolved;
+                  r.search_rank     = branch.rank;
+                  add_result(result, r);
+                  m_levels_resolved = levels_resolved;
+                }
+              else if (id < last_subobject)
+                {
+                  // search subobjects for ones with the same postal code
+                  // there is a point to start searching only if there are
+                  // subobjects only
+                  std::string qtxt
+                      = "SELECT o.id, o.latitude, o.longitude, o.search_rank "
+                        "FROM object_primary o WHERE "
+                        "o.postal_code=:pcode AND o.id>:min AND o.id<=:max "
+                        + viewport_condition();
+                  sqlite3pp::query qry(m_index->db, qtxt.c_str());
+                  qry.bind(":pcode", postal_code.c_str(), sqlite3pp::nocopy);
+                  qry.bind(":min", id);
+                  qry.bind(":max", last_subobject);
+#ifdef GEONLP_PRINT_SQL
+                  std::cout << "SELECT id FROM object_primary WHERE postal_code='"
+                            << postal_code << "' AND id>" << id << " AND id<=" << last_subobject
+                            << "\n";
+#endif
+                  for (auto v : qry)
                     {
-                      long long int      id = *idx;
-                      IntermediateResult r(std::string(agent.key().ptr(), agent.key().length()),
-                                           id);
-                      search_result.push_back(r);
+                      GeoResult r;
+                      v.getter() >> r.id >> r.latitude >> r.longitude >> r.search_rank;
+                      r.levels_resolved = levels_resolved;
+                      if (location_aware)
+                        r.search_rank = location_rank(r.search_rank, m_reference.distance(r));
+                      add_result(result, r);
+                      m_levels_resolved = levels_resolved;
+                      if (!location_aware && m_max_results > 0
+                          && result.size() >= m_max_inter_results)
+                        break;
                     }
                 }
             }
-          else
-            {
-              std::cerr << "Internal inconsistency of the databases: TRIE " << agent.key().id()
-                        << "\n";
-            }
         }
     }
+}
 
-  std::sort(search_result.begin(), search_result.end());
-
-  bool last_level = (level + 1 >= parsed.size());
-  for (const IntermediateResult &branch : search_result)
+Geocoder::SearchStrategy Geocoder::plan(const ParsedQuery::Hierarchy &parsed,
+                                        const std::string &postal_code, size_t &start_level)
+{
+  start_level = 0;
+  if (m_search_strategy == StrategyTopDown || parsed.size() < 2)
+    return StrategyTopDown;
+
+  // levels are kept in bit masks while merging
+  const bool can_merge = postal_code.empty() && parsed.size() <= 64;
+  if (m_search_strategy == StrategyMergeJoin)
+    return can_merge ? StrategyMergeJoin : StrategyTopDown;
+
+  // the most selective level is estimated by the number of ids in
+  // its posting lists
+  std::vector<size_t> counts;
+  for (size_t level = 0; level < parsed.size(); ++level)
     {
-      long long int id             = branch.id;
-      long long int last_subobject = id;
+      counts.push_back(level_postings(parsed, level));
+      if (counts[level] < counts[start_level])
+        start_level = level;
+    }
 
-      if (ids_explored.count(id) > 0)
-        continue; // has been looked into it already
+  // with many candidates at each level, merging the posting lists
+  // is cheaper than exploring the branches one by one
+  if (m_search_strategy == StrategyAuto && can_merge
+      && counts[start_level] >= m_merge_join_min_candidates)
+    return StrategyMergeJoin;
+
+  if (start_level == 0)
+    return StrategyTopDown;
+
+  if (m_search_strategy == StrategyBottomUp)
+    return StrategyBottomUp;
+
+  // top-down search goes through the candidates of the levels above
+  // the selective one, bottom-up search checks the ancestors of each
+  // of its candidates
+  size_t cost_top_down = 0;
+  for (size_t level = 0; level <= start_level; ++level)
+    cost_top_down += counts[level];
+  const size_t cost_bottom_up = counts[start_level] * (start_level + 1);
+
+#ifdef GEONLP_PRINT_DEBUG_QUERIES
+  std::cout << "Plan: start level " << start_level << ", cost top-down " << cost_top_down
+            << ", bottom-up " << cost_bottom_up << "\n";
+#endif
+
+  return cost_bottom_up < cost_top_down ? StrategyBottomUp : StrategyTopDown;
+}
+
+bool Geocoder::search_bottom_up(const ParsedQuery::Hierarchy &parsed,
+                                const std::string &postal_code, std::vector<GeoResult> &result,
+                                size_t level)
+{
+  std::set<long long int>         ids_explored;
+  std::shared_ptr<const Branches> branches = memo_branches(parsed, level, 0, 0, true);
+  const bool                      location_aware = m_reference.is_set();
+
+  for (const IntermediateResult &branch : *branches)
+    {
+      if (ids_explored.count(branch.id) > 0)
+        continue;
 
       if (parsed.size() < m_levels_resolved
           || (parsed.size() == m_levels_resolved && m_max_results > 0
-              && result.size() >= m_max_inter_results))
-        break; // this search cannot add more results
+              && result.size() >= m_max_inter_results
+              && (!location_aware || branch.bound >= worst_location_rank(result))))
+        break; // this search cannot add more or better results
+
+      // the levels above have to be matched by the ancestors, in order
+      bool postal_is_ok = postal_code.empty();
+      if (!match_ancestors(parsed, level, branch.id, postal_code, postal_is_ok))
+        continue;
+
+      ids_explored.insert(branch.id);
+      search_branch(parsed, postal_is_ok ? "" : postal_code, result, level, branch);
+    }
+
+  return !ids_explored.empty();
+}
+
+bool Geocoder::search_merge_join(const ParsedQuery::Hierarchy &parsed,
+                                 std::vector<GeoResult>       &result)
+{
+  const size_t levels = parsed.size();
+
+  std::vector<std::shared_ptr<const LevelIds> > lists;
+  std::vector<index_id_value>                    all;
+  for (size_t l = 0; l < levels; ++l)
+    {
+      lists.push_back(level_ids(parsed, l));
+      all.insert(all.end(), lists.back()->ids.begin(), lists.back()->ids.end());
+    }
 
-      ids_explored.insert(id);
+  std::sort(all.begin(), all.end());
+  all.erase(std::unique(all.begin(), all.end()), all.end());
+  memo_last_subobjects(all);
 
-      // if postal code is assigned to this level and is correct,
-      // all subobjects will have the same postal code. check if postal
-      // code is resolved
-      bool postal_is_ok = (postal_code.empty() || get_postal_code(id) == postal_code);
+  // open interval of a match. valid has a bit set for each level the
+  // object is a match of, child for each level that has a match of
+  // the next level among the subobjects, and reach combines valid
+  // bits of the object and its ancestors
+  struct Interval
+  {
+    long long int id;
+    long long int last;
+    uint64_t      valid;
+    uint64_t      child;
+    uint64_t      reach;
+  };
 
-      // are we interested in this result even if it doesn't have subregions?
-      if (!last_level || !postal_is_ok)
+  std::vector<Interval>                          open;
+  std::vector<std::pair<long long int, size_t> > found; // id and resolved levels
+  size_t                                         max_levels = 0;
+
+  // matches without the match of the next level among the subobjects
+  // are results, as in the top-down search
+  auto close = [&](const Interval &interval) {
+    for (size_t l = 0; l < levels; ++l)
+      if ((interval.valid & (1ULL << l)) && (l + 1 == levels || !(interval.child & (1ULL << l))))
         {
-          sqlite3pp::query qry(m_db, "SELECT last_subobject FROM hierarchy WHERE prim_id=?");
-          qry.bind(1, id);
-          for (auto v : qry)
-            {
-              // only one entry is expected
-              v.getter() >> last_subobject;
-              break;
-            }
+          found.push_back(std::make_pair(interval.id, l + 1));
+          max_levels = std::max(max_levels, l + 1);
+        }
+  };
+
+  std::vector<size_t> pos(levels, 0);
+  for (index_id_value x : all)
+    {
+      while (!open.empty() && open.back().last < x)
+        {
+          close(open.back());
+          open.pop_back();
+        }
+
+      // levels of the id, the lists are advanced in step with the merge
+      uint64_t levels_of_x = 0;
+      for (size_t l = 0; l < levels; ++l)
+        if (pos[l] < lists[l]->ids.size() && lists[l]->ids[pos[l]] == x)
+          {
+            levels_of_x |= (1ULL << l);
+            ++pos[l];
+          }
+
+      // all open intervals contain x
+      const uint64_t reach = open.empty() ? 0 : open.back().reach;
+      const uint64_t valid = levels_of_x & ((reach << 1) | 1ULL);
+      if (!valid)
+        continue;
+
+      for (Interval &a : open)
+        a.child |= a.valid & (valid >> 1);
 
-          // check if we have results which are better than this one if it
-          // does not have any subobjects
-          if (m_levels_resolved > level + 1 && id >= last_subobject)
-            continue; // take the next search_result
+      open.push_back(Interval{ x, memo_last_subobject(x), valid, 0, reach | valid });
+    }
+
+  for (auto a = open.rbegin(); a != open.rend(); ++a)
+    close(*a);
+
+  if (max_levels == 0 || max_levels < m_levels_resolved)
+    return !found.empty();
+
+  // results are added in the order of the top-down search, starting
+  // from the objects matched by the shortest keys. without the
+  // location bias, add_result keeps the first ones
+  const LevelIds                                &matched = *lists[max_levels - 1];
+  std::vector<std::pair<size_t, long long int> > ranked;
+  for (const auto &f : found)
+    if (f.second == max_levels)
+      {
+        const size_t i = std::lower_bound(matched.ids.begin(), matched.ids.end(), f.first)
+                         - matched.ids.begin();
+        ranked.push_back(std::make_pair(matched.key_length[i], f.first));
+      }
+
+  std::sort(ranked.begin(), ranked.end());
+
+  std::vector<long long int> ids;
+  for (const auto &r : ranked)
+    ids.push_back(r.second);
+
+  std::map<long long int, BranchBounds> bounds;
+  if (m_reference.is_set() || !m_viewport.empty())
+    branch_bounds(ids, bounds);
+
+  if (max_levels > m_levels_resolved)
+    {
+      result.clear();
+      m_levels_resolved = max_levels;
+    }
+
+  std::set<long long int> have_already;
+  for (const GeoResult &r : result)
+    have_already.insert(r.id);
+
+  for (long long int id : ids)
+    {
+      if (!have_already.insert(id).second)
+        continue;
+
+      GeoResult r;
+      r.id              = id;
+      r.levels_resolved = max_levels;
+
+      auto b = bounds.find(id);
+      if (b != bounds.end())
+        {
+          if (!b->second.visible)
+            continue;
+          r.search_rank = b->second.rank;
         }
 
-      if (last_level || last_subobject <= id
-          || !search(parsed, postal_is_ok ? "" : postal_code, result, level + 1, id + 1,
-                     last_subobject))
+      add_result(result, r);
+    }
+
+  return true;
+}
+
+bool Geocoder::match_ancestors(const ParsedQuery::Hierarchy &parsed, size_t level, long long int id,
+                               const std::string &postal_code, bool &postal_is_ok)
+{
+  // with the nested ids, the ancestor A of B satisfies A < B <=
+  // last_subobject(A). for each level, its matches preceding B are
+  // checked starting from the nearest one, as it leaves the most
+  // ancestors for the levels above. last subobjects of the matches
+  // are fetched in blocks
+  const std::ptrdiff_t block      = 64;
+  long long int        descendant = id;
+  for (size_t l = level; l-- > 0;)
+    {
+      std::shared_ptr<const LevelIds>    matches = level_ids(parsed, l);
+      const std::vector<index_id_value> &ids     = matches->ids;
+
+      auto end   = std::lower_bound(ids.begin(), ids.end(), descendant);
+      bool found = false;
+      while (!found && end != ids.begin())
         {
-          size_t levels_resolved = level + 1;
-          bool   newlevel        = false;
-          if (m_levels_resolved < levels_resolved)
+          auto begin = end - std::min(block, end - ids.begin());
+          memo_last_subobjects(std::vector<index_id_value>(begin, end));
+          while (!found && end != begin)
             {
-              result.clear();
-              newlevel = true;
+              --end;
+              found = (memo_last_subobject(*end) >= descendant);
             }
+        }
 
-          if ((m_levels_resolved == levels_resolved || newlevel)
-              && (m_max_results == 0 || result.size() < m_max_inter_results))
+      if (!found)
+        return false;
+
+      descendant = *end;
+      if (!postal_is_ok && memo_postal_code(descendant) == postal_code)
+        postal_is_ok = true;
+    }
+
+  return true;
+}
+
+void Geocoder::SearchMemo::clear()
+{
+  trie.clear();
+  keys.clear();
+  branches.clear();
+  level_ids.clear();
+  last_subobject.clear();
+  postal_code.clear();
+}
+
+const std::vector<size_t> &Geocoder::memo_trie(const std::string &expansion)
+{
+  auto m = m_memo.trie.find(expansion);
+  if (m != m_memo.trie.end())
+    return m->second;
+
+  std::vector<size_t> &ids = m_memo.trie[expansion];
+  marisa::Agent        agent;
+  agent.set_query(expansion.c_str());
+  while (m_search_index->trie.predictive_search(agent))
+    {
+      const size_t key_id = agent.key().id();
+      ids.push_back(key_id);
+      if (m_memo.keys.count(key_id))
+        continue;
+
+      SearchMemo::Key &key = m_memo.keys[key_id];
+      key.key.assign(agent.key().ptr(), agent.key().length());
+      key.found = m_search_index->norm_id.get(make_id_key(key_id), &key.postings);
+      if (!key.found)
+        std::cerr << "Internal inconsistency of the databases: TRIE " << key_id << "\n";
+    }
+
+  return ids;
+}
+
+std::shared_ptr<const Geocoder::Branches>
+Geocoder::memo_branches(const ParsedQuery::Hierarchy &parsed, size_t level, long long int range0,
+                        long long int range1, bool full_range)
+{
+  // branches depend only on the expansions of the level and the
+  // parent range, as the reference and the viewport are the same for
+  // the whole query
+  std::string memo_key = full_range ? std::string("full")
+                                    : std::to_string(range0) + ":" + std::to_string(range1);
+  for (const std::string &s : parsed[level])
+    {
+      memo_key.push_back('\0');
+      memo_key += s;
+    }
+
+  auto m = m_memo.branches.find(memo_key);
+  if (m != m_memo.branches.end())
+    return m->second;
+
+  std::shared_ptr<Branches> branches     = std::make_shared<Branches>();
+  Branches                 &search_result = *branches;
+  for (const std::string &s : parsed[level])
+    for (size_t key_id : memo_trie(s))
+      {
+        SearchMemo::Key &key = m_memo.keys[key_id];
+        index_id_value  *idx, *idx1;
+        if (key.found && get_id_range(key.postings, full_range, range0, range1, &idx, &idx1))
+          for (; idx < idx1; ++idx)
+            search_result.push_back(IntermediateResult(key.key, *idx));
+      }
+
+  std::sort(search_result.begin(), search_result.end());
+
+  // drop the branches that are outside the viewport and, with the
+  // location bias, explore the branches starting from the ones that
+  // can give the best ranked results
+  const bool location_aware = m_reference.is_set();
+  if ((location_aware || !m_viewport.empty()) && !search_result.empty())
+    {
+      std::vector<long long int> ids;
+      for (const IntermediateResult &branch : search_result)
+        ids.push_back(branch.id);
+
+      std::map<long long int, BranchBounds> bounds;
+      branch_bounds(ids, bounds);
+
+      Branches visible;
+      for (IntermediateResult &branch : search_result)
+        {
+          auto b = bounds.find(branch.id);
+          if (b != bounds.end())
             {
-              bool have_already = false;
-              for (const auto &r : result)
-                if (r.id == id)
-                  {
-                    have_already = true;
-                    break;
-                  }
-
-              if (!have_already)
-                {
-                  if (postal_is_ok)
-                    {
-                      GeoResult r;
-                      r.id              = id;
-                      r.levels_resolved = levels_resolved;
-                      result.push_back(r);
-                      m_levels_resolved = levels_resolved;
-                    }
-                  else if (id < last_subobject)
-                    {
-                      // search subobjects for ones with the same postal code
-                      // there is a point to start searching only if there are
-                      // subobjects only
-                      sqlite3pp::query qry(m_db, "SELECT id FROM object_primary WHERE "
-                                                 "postal_code=:pcode AND id>:min AND id<=:max");
-                      qry.bind(":pcode", postal_code.c_str(), sqlite3pp::nocopy);
-                      qry.bind(":min", id);
-                      qry.bind(":max", last_subobject);
+              if (!b->second.subtree_visible)
+                continue;
+              branch.bound   = b->second.bound;
+              branch.rank    = b->second.rank;
+              branch.visible = b->second.visible;
+            }
+          visible.push_back(branch);
+        }
+      search_result.swap(visible);
+
+      if (location_aware)
+        std::stable_sort(search_result.begin(), search_result.end(),
+                         [](const IntermediateResult &a, const IntermediateResult &b) {
+                           return a.bound < b.bound;
+                         });
+    }
+
+  m_memo.branches[memo_key] = branches;
+  return branches;
+}
+
+std::string Geocoder::level_key(const ParsedQuery::Hierarchy &parsed, size_t level)
+{
+  std::string key;
+  for (const std::string &s : parsed[level])
+    {
+      key.push_back('\0');
+      key += s;
+    }
+  return key;
+}
+
+size_t Geocoder::level_postings(const ParsedQuery::Hierarchy &parsed, size_t level)
+{
+  std::set<size_t> keys;
+  for (const std::string &s : parsed[level])
+    {
+      const std::vector<size_t> &ids = memo_trie(s);
+      keys.insert(ids.begin(), ids.end());
+    }
+
+  size_t count = 0;
+  for (size_t key_id : keys)
+    count += get_id_number_of_values(m_memo.keys[key_id].postings);
+  return count;
+}
+
+std::shared_ptr<const Geocoder::LevelIds>
+Geocoder::level_ids(const ParsedQuery::Hierarchy &parsed, size_t level)
+{
+  const std::string key = level_key(parsed, level);
+  auto              m   = m_memo.level_ids.find(key);
+  if (m != m_memo.level_ids.end())
+    return m->second;
+
+  std::set<size_t> keys;
+  for (const std::string &s : parsed[level])
+    {
+      const std::vector<size_t> &k = memo_trie(s);
+      keys.insert(k.begin(), k.end());
+    }
+
+  // ids with the lengths of the matching keys, the shortest key is
+  // kept for each id
+  std::vector<std::pair<index_id_value, size_t> > matches;
+  for (size_t key_id : keys)
+    {
+      const SearchMemo::Key &k = m_memo.keys[key_id];
+      const index_id_value  *v = (const index_id_value *)k.postings.data();
+      for (size_t i = 0; i < get_id_number_of_values(k.postings); ++i)
+        matches.push_back(std::make_pair(v[i], k.key.length()));
+    }
+
+  std::sort(matches.begin(), matches.end());
+
+  std::shared_ptr<LevelIds> ids = std::make_shared<LevelIds>();
+  for (const auto &match : matches)
+    if (ids->ids.empty() || ids->ids.back() != match.first)
+      {
+        ids->ids.push_back(match.first);
+        ids->key_length.push_back(match.second);
+      }
+
+  m_memo.level_ids[key] = ids;
+  return ids;
+}
+
+void Geocoder::memo_last_subobjects(const std::vector<index_id_value> &ids)
+{
+  std::vector<index_id_value> missing;
+  for (index_id_value id : ids)
+    if (!m_memo.last_subobject.count(id))
+      missing.push_back(id);
+
+  // objects without subobjects don't have hierarchy record
+  for (index_id_value id : missing)
+    m_memo.last_subobject[id] = id;
+
+  const size_t ids_per_query = 500;
+  for (size_t start = 0; start < missing.size(); start += ids_per_query)
+    {
+      std::ostringstream qtxt;
+      qtxt << "SELECT prim_id, last_subobject FROM hierarchy WHERE prim_id IN (";
+      for (size_t i = start; i < missing.size() && i < start + ids_per_query; ++i)
+        {
+          if (i > start)
+            qtxt << ",";
+          qtxt << missing[i];
+        }
+      qtxt << ")";
+
 #ifdef GEONLP_PRINT_SQL
-                      std::cout << "SELECT id FROM object_primary WHERE postal_code='"
-                                << postal_code << "' AND id>" << id << " AND id<=" << last_subobject
-                                << "\n";
+      std::cout << qtxt.str() << "\n";
 #endif
-                      for (auto v : qry)
-                        {
-                          GeoResult r;
-                          v.getter() >> r.id;
-                          r.levels_resolved = levels_resolved;
-                          result.push_back(r);
-                          m_levels_resolved = levels_resolved;
-                          if (m_max_results > 0 && result.size() >= m_max_inter_results)
-                            break;
-                        }
-                    }
-                }
-            }
+      sqlite3pp::query qry(m_index->db, qtxt.str().c_str());
+      for (auto v : qry)
+        {
+          long long int id, last_subobject;
+          v.getter() >> id >> last_subobject;
+          m_memo.last_subobject[id] = last_subobject;
         }
     }
+}
 
-  return !ids_explored.empty();
+long long int Geocoder::memo_last_subobject(long long int id)
+{
+  auto m = m_memo.last_subobject.find(id);
+  if (m != m_memo.last_subobject.end())
+    return m->second;
+
+  long long int    last_subobject = id;
+  sqlite3pp::query qry(m_index->db, "SELECT last_subobject FROM hierarchy WHERE prim_id=?");
+  qry.bind(1, id);
+  for (auto v : qry)
+    {
+      // only one entry is expected
+      v.getter() >> last_subobject;
+      break;
+    }
+
+  m_memo.last_subobject[id] = last_subobject;
+  return last_subobject;
+}
+
+std::string Geocoder::memo_postal_code(long long int id)
+{
+  auto m = m_memo.postal_code.find(id);
+  if (m != m_memo.postal_code.end())
+    return m->second;
+  return m_memo.postal_code[id] = get_postal_code(id);
 }
 
 void Geocoder::get_name(long long id, std::string &title, std::string &full, size_t &admin_levels,
@@ -510,7 +1353,7 @@ void Geocoder::get_name(long long id, std::string &title, std::string &full, siz
   std::string   name_en;
   std::string   toadd;
 
-  sqlite3pp::query qry(m_db,
+  sqlite3pp::query qry(m_index->db,
                        "SELECT name, name_extra, name_en, parent FROM object_primary WHERE id=?");
   qry.bind(1, id);
   for (auto v : qry)
@@ -563,7 +1406,7 @@ std::string Geocoder::get_postal_code(long long id)
 {
   char const *postal_code = nullptr;
 
-  sqlite3pp::query qry(m_db, "SELECT postal_code FROM object_primary WHERE id=?");
+  sqlite3pp::query qry(m_index->db, "SELECT postal_code FROM object_primary WHERE id=?");
   qry.bind(1, id);
 
   for (auto v : qry)
@@ -579,8 +1422,8 @@ std::string Geocoder::get_type(long long id)
 {
   std::string name;
 
-  sqlite3pp::query qry(
-      m_db, "SELECT t.name FROM object_primary o JOIN type t ON t.id=o.type_id WHERE o.id=?");
+  sqlite3pp::query qry(m_index->db, "SELECT t.name FROM object_primary o "
+                                    "JOIN type t ON t.id=o.type_id WHERE o.id=?");
   qry.bind(1, id);
 
   for (auto v : qry)
@@ -598,7 +1441,8 @@ std::string Geocoder::get_type(long long id)
 
 void Geocoder::get_features(GeoResult &r)
 {
-  sqlite3pp::query qry(m_db, "SELECT phone, postal_code, website FROM object_primary WHERE id=?");
+  sqlite3pp::query qry(m_index->db,
+                       "SELECT phone, postal_code, website FROM object_primary WHERE id=?");
   qry.bind(1, r.id);
   for (auto v : qry)
     {
@@ -638,6 +1482,17 @@ bool Geocoder::get_id_range(std::string &v, bool full_range, index_id_value rang
   return true;
 }
 
+bool Geocoder::has_normalized_key(const std::string &key)
+{
+  IndexLock lock(*this, true);
+  if (!lock)
+    return false;
+
+  marisa::Agent agent;
+  agent.set_query(key.c_str(), key.length());
+  return m_search_index->trie.lookup(agent);
+}
+
 // search next to the reference point
 bool Geocoder::search_nearby(const std::vector<std::string> &name_query,
                              const std::vector<std::string> &type_query, double latitude,
@@ -647,6 +1502,10 @@ bool Geocoder::search_nearby(const std::vector<std::string> &name_query,
   if (radius < 0)
     return false;
 
+  IndexLock lock(*this);
+  if (!lock)
+    return false;
+
   // rough estimates of distance (meters) per degree
   //
   const double dist_per_degree_lat = distance_per_latitude();
@@ -654,12 +1513,16 @@ bool Geocoder::search_nearby(const std::vector<std::string> &name_query,
 
   try
     {
+      // spatial window is covered by a few ranges of cell ids
+      const BoundingBox bbox(
+          latitude - radius / dist_per_degree_lat, latitude + radius / dist_per_degree_lat,
+          longitude - radius / dist_per_degree_lon, longitude + radius / dist_per_degree_lon);
+
       std::ostringstream qtxt;
       qtxt << "SELECT o.id, o.name, o.name_extra, o.name_en, t.name, o.latitude, o.longitude, "
               "o.search_rank "
            << "FROM object_primary o "
            << "JOIN type t ON o.type_id=t.id "
-           << "JOIN object_primary_rtree ON (o.box_id = object_primary_rtree.id) "
            << "WHERE ";
 
       if (!type_query.empty())
@@ -676,17 +1539,12 @@ bool Geocoder::search_nearby(const std::vector<std::string> &name_query,
           qtxt << tqfull << ") AND ";
         }
 
-      qtxt << "maxLat>=:minLat AND minLat<=:maxLat AND maxLon >= :minLon AND minLon <= :maxLon";
+      qtxt << cell_condition(SpatialCell::cover(bbox));
 
 #ifdef GEONLP_PRINT_SQL
       std::cout << qtxt.str() << "\n";
 #endif
-      sqlite3pp::query qry(m_db, qtxt.str().c_str());
-
-      qry.bind(":minLat", latitude - radius / dist_per_degree_lat);
-      qry.bind(":maxLat", latitude + radius / dist_per_degree_lat);
-      qry.bind(":minLon", longitude - radius / dist_per_degree_lon);
-      qry.bind(":maxLon", longitude + radius / dist_per_degree_lon);
+      sqlite3pp::query qry(m_index->db, qtxt.str().c_str());
 
       for (auto v : qry)
         {
@@ -710,7 +1568,6 @@ bool Geocoder::search_nearby(const std::vector<std::string> &name_query,
           // check name query
           if (!name_query.empty())
             {
-              bool                  found = false;
               std::set<std::string> names;
               if (name)
                 names.insert(name);
@@ -718,22 +1575,7 @@ bool Geocoder::search_nearby(const std::vector<std::string> &name_query,
                 names.insert(name_extra);
               if (name_en)
                 names.insert(name_en);
-              for (auto n = names.begin(); n != names.end() && !found; ++n)
-                {
-                  if (n->empty())
-                    continue;
-                  std::vector<std::string> expanded;
-                  postal.expand_string(*n, expanded);
-
-                  for (auto q = name_query.cbegin(); !found && q != name_query.cend(); ++q)
-                    for (auto e = expanded.begin(); !found && e != expanded.end(); ++e)
-                      // search is for whether the name starts with the query or has
-                      // the query after space (think of street Dr. Someone and query Someone)
-                      found = (e->compare(0, q->length(), *q) == 0
-                               || e->find(" " + *q) != std::string::npos);
-                }
-
-              if (!found)
+              if (!name_matches(name_query, names, postal))
                 continue; // substring not found
             }
 
@@ -778,253 +1620,80 @@ bool Geocoder::search_nearby(const std::vector<std::string> &name_query,
   if (radius < 0 || latitude.size() < 2 || latitude.size() != longitude.size())
     return false;
 
-  // const double earth_radius = 6378137;
-  const double radius2 = radius * radius;
-
-  // // fill linestring
-  // boost::geometry::model::linestring<point_t> ls;
-  // for (size_t i=0; i < latitude.size(); ++i)
-  //   boost::geometry::append(ls, point_t(longitude[i],latitude[i]));
-
-  try
-    {
-
-      std::set<long long> processed_boxes;
-      double              line_distance = 0;
-      for (size_t LineI = skip_points;
-           LineI < longitude.size() - 1 && (m_max_results == 0 || result.size() <= m_max_results);
-           ++LineI)
-        {
-
-          // rough estimates of distance (meters) per degree
-          const double dist_per_degree_lat = distance_per_latitude();
-          const double dist_per_degree_lon = distance_per_longitude(latitude[LineI]);
-          {
-            double x1 = latitude[LineI] * dist_per_degree_lat;
-            double y1 = longitude[LineI] * dist_per_degree_lon;
-            double x2 = latitude[LineI + 1] * dist_per_degree_lat;
-            double y2 = longitude[LineI + 1] * dist_per_degree_lon;
-            double dx = x2 - x1;
-            double dy = y2 - y1;
-            line_distance += sqrt(dx * dx + dy * dy);
-          }
-
-          // step 1: get boxes that are near the line segment
-          std::deque<long long> newboxes;
-          {
-            sqlite3pp::query qry(m_db, "SELECT id, minLat, maxLat, minLon, maxLon "
-                                       "FROM object_primary_rtree "
-                                       "WHERE maxLat>=:minLat AND minLat<=:maxLat AND maxLon >= "
-                                       ":minLon AND minLon <= :maxLon");
-
-            auto bb_lat = std::minmax(latitude[LineI], latitude[LineI + 1]);
-            auto bb_lon = std::minmax(longitude[LineI], longitude[LineI + 1]);
-
-            qry.bind(":minLat", bb_lat.first - radius / dist_per_degree_lat);
-            qry.bind(":maxLat", bb_lat.second + radius / dist_per_degree_lat);
-            qry.bind(":minLon", bb_lon.first - radius / dist_per_degree_lon);
-            qry.bind(":maxLon", bb_lon.second + radius / dist_per_degree_lon);
-
-            for (auto v : qry)
-              {
-                long long id;
-                double    minLat, maxLat, minLon, maxLon;
-                v.getter() >> id >> minLat >> maxLat >> minLon >> maxLon;
-
-                if (processed_boxes.count(id))
-                  continue;
-                processed_boxes.insert(id);
-                newboxes.push_back(id);
-              }
-          }
-
-          // check if anything is new
-          if (newboxes.empty())
-            continue;
-
-          // step 2: search for objects from new boxes
-          {
-            std::ostringstream qtxt;
-            qtxt << "SELECT o.id, o.name, o.name_extra, o.name_en, t.name, "
-                 << "o.latitude, o.longitude, o.search_rank "
-                 << "FROM object_primary o "
-                 << "JOIN type t ON o.type_id=t.id "
-                 << "WHERE ";
-
-            if (!type_query.empty())
-              {
-                std::string tqfull;
-                for (auto tq : type_query)
-                  {
-                    if (!tqfull.empty())
-                      tqfull += " OR ";
-                    else
-                      tqfull = "(";
-                    tqfull += " t.name = '" + tq + "'";
-                  }
-                qtxt << tqfull << ") AND ";
-              }
-
-            qtxt << " o.box_id IN (";
-            for (size_t i = 0; i < newboxes.size(); ++i)
-              {
-                if (i)
-                  qtxt << ", ";
-                qtxt << newboxes[i];
-              }
-            qtxt << ")";
-#ifdef GEONLP_PRINT_SQL
-            std::cout << qtxt.str() << "\n";
-#endif
-            sqlite3pp::query qry(m_db, qtxt.str().c_str());
-
-            for (auto v : qry)
-              {
-                long long   id;
-                char const *name, *name_extra, *name_en;
-                std::string type;
-                double      lat, lon, distance;
-                int         search_rank;
-                v.getter() >> id >> name >> name_extra >> name_en >> type >> lat >> lon
-                    >> search_rank;
-
-                // check if distance is ok using earth as a plane approximation around the line
-                {
-                  double       distance2 = -1;
-                  const double xp        = lat * dist_per_degree_lat;
-                  const double yp        = lon * dist_per_degree_lon;
-                  double       u = 0, nrm2 = 0; // cache the last result for distance
-                  for (size_t i = LineI;
-                       i < longitude.size() - 1 && (distance2 < 0 || distance2 > radius2); ++i)
-                    {
-                      // constants used for distance calculations, drop when
-                      // moving back to boost geometry
-                      const double x1 = latitude[i] * dist_per_degree_lat;
-                      const double y1 = longitude[i] * dist_per_degree_lon;
-                      const double x2 = latitude[i + 1] * dist_per_degree_lat;
-                      const double y2 = longitude[i + 1] * dist_per_degree_lon;
-                      const double px = x2 - x1;
-                      const double py = y2 - y1;
-                      nrm2            = px * px + py * py;
-
-                      u = ((xp - x1) * px + (yp - y1) * py) / nrm2;
-                      u = std::max(0.0, std::min(1.0, u));
-
-                      double dx = (x1 + u * px) - xp;
-                      double dy = (y1 + u * py) - yp;
-                      double dd = dx * dx + dy * dy;
-
-                      if (distance2 < 0 || distance2 > dd)
-                        distance2 = dd;
-                    }
-
-                  if (distance2 > radius2)
-                    continue;
-
-                  distance = line_distance - (1 - u) * sqrt(nrm2);
-                }
-                // // distance check using boost
-                // if ( boost::geometry::distance(point_t(lon, lat), ls)*earth_radius > radius )
-                //   continue; // skip this result
-
-                // check name query
-                if (!name_query.empty())
-                  {
-                    bool                  found = false;
-                    std::set<std::string> names;
-                    if (name)
-                      names.insert(name);
-                    if (name_extra)
-                      names.insert(name_extra);
-                    if (name_en)
-                      names.insert(name_en);
-                    for (auto n = names.begin(); n != names.end() && !found; ++n)
-                      {
-                        if (n->empty())
-                          continue;
-                        std::vector<std::string> expanded;
-                        postal.expand_string(*n, expanded);
-
-                        for (auto q = name_query.cbegin(); !found && q != name_query.cend(); ++q)
-                          for (auto e = expanded.begin(); !found && e != expanded.end(); ++e)
-                            // search is for whether the name starts with the query or has
-                            // the query after space (think of street Dr. Someone and query Someone)
-                            found = (e->compare(0, q->length(), *q) == 0
-                                     || e->find(" " + *q) != std::string::npos);
-                      }
-
-                    if (!found)
-                      continue; // substring not found
-                  }
-
-                GeoResult r;
-                r.id = id;
-
-                get_name(r.id, r.title, r.address, r.admin_levels, m_levels_in_title);
-                r.type = get_type(r.id);
-                get_features(r);
-
-                r.latitude        = lat;
-                r.longitude       = lon;
-                r.distance        = distance;
-                r.search_rank     = search_rank;
-                r.levels_resolved = 1; // not used in this search
-
-                result.push_back(r);
-              }
-          }
-        }
-    }
-  catch (sqlite3pp::database_error &e)
-    {
-      std::cerr << "Geocoder exception: " << e.what() << std::endl;
-      return false;
-    }
+  // single search along the whole route
+  CorridorSearch search(*this, postal);
+  search.set_query(name_query, type_query);
+  search.set_lookahead(-1);
+  if (!search.set_route(latitude, longitude, radius))
+    return false;
 
-  return true;
+  std::vector<GeoResult> passed;
+  return search.advance(skip_points, result, passed);
 }
 
 int Geocoder::closest_segment(const std::vector<double> &latitude,
                               const std::vector<double> &longitude, double reference_latitude,
                               double reference_longitude)
+{
+  size_t segment;
+  double offset;
+  if (!closest_segment(latitude, longitude, reference_latitude, reference_longitude, segment,
+                       offset))
+    return -1;
+  return segment;
+}
+
+bool Geocoder::closest_segment(const std::vector<double> &latitude,
+                               const std::vector<double> &longitude, double reference_latitude,
+                               double reference_longitude, size_t &segment, double &offset)
 {
   // make all checks first
   if (latitude.size() < 2 || latitude.size() != longitude.size())
-    return -1;
+    return false;
 
-  // rough estimates of distance (meters) per degree
-  const double dist_per_degree_lat = distance_per_latitude();
-  const double dist_per_degree_lon = distance_per_longitude(reference_latitude);
+  Polyline             line(latitude, longitude);
+  Polyline::Projection projection;
+  if (!line.closest(reference_latitude, reference_longitude, projection))
+    return false;
 
-  const double xp = reference_latitude * dist_per_degree_lat;
-  const double yp = reference_longitude * dist_per_degree_lon;
+  segment = projection.segment;
+  offset  = projection.offset;
+  return true;
+}
 
-  size_t currI  = 0;
-  double currD2 = -1;
-  for (size_t i = 0; i < longitude.size() - 1; ++i)
+std::string Geocoder::cell_condition(const std::vector<SpatialCell::Range> &ranges)
+{
+  std::ostringstream qtxt;
+  qtxt << "(";
+  for (size_t i = 0; i < ranges.size(); ++i)
     {
-      const double x1   = latitude[i] * dist_per_degree_lat;
-      const double y1   = longitude[i] * dist_per_degree_lon;
-      const double x2   = latitude[i + 1] * dist_per_degree_lat;
-      const double y2   = longitude[i + 1] * dist_per_degree_lon;
-      const double px   = x2 - x1;
-      const double py   = y2 - y1;
-      const double nrm2 = px * px + py * py;
-
-      double u  = ((xp - x1) * px + (yp - y1) * py) / nrm2;
-      u         = std::max(0.0, std::min(1.0, u));
-      double dx = (x1 + u * px) - xp;
-      double dy = (y1 + u * py) - yp;
-      double dd = dx * dx + dy * dy;
-
-      if (currD2 < 0 || currD2 > dd)
-        {
-          currI  = i;
-          currD2 = dd;
-        }
+      if (i > 0)
+        qtxt << " OR ";
+      qtxt << "o.cell_id BETWEEN " << ranges[i].first << " AND " << ranges[i].last;
     }
+  qtxt << ")";
+  return qtxt.str();
+}
 
-  return currI;
+bool Geocoder::name_matches(const std::vector<std::string> &name_query,
+                            const std::set<std::string> &names, Postal &postal)
+{
+  for (auto n = names.begin(); n != names.end(); ++n)
+    {
+      if (n->empty())
+        continue;
+      std::vector<std::string> expanded;
+      postal.expand_string(*n, expanded);
+
+      for (auto q = name_query.cbegin(); q != name_query.cend(); ++q)
+        for (auto e = expanded.begin(); e != expanded.end(); ++e)
+          // search is for whether the name starts with the query or has
+          // the query after space (think of street Dr. Someone and query Someone)
+          if (e->compare(0, q->length(), *q) == 0 || e->find(" " + *q) != std::string::npos)
+            return true;
+    }
+
+  return false;
 }
 
 double Geocoder::search_rank_location_bias(double distance, int zoom)
@@ -1040,3 +1709,112 @@ double Geocoder::search_rank_location_bias(double distance, int zoom)
   double radius = (1 << (18 - zoom)) * 250; // meters
   return exp(-distance / radius);
 }
+
+double Geocoder::location_rank(double search_rank, double distance) const
+{
+  // Here, 1000 is used to scale search_rank. Same factor is used in Geocoder importer
+  return search_rank
+         - m_reference.importance() * 1000
+               * search_rank_location_bias(distance, m_reference.zoom());
+}
+
+void Geocoder::branch_bounds(const std::vector<long long int>     &ids,
+                             std::map<long long int, BranchBounds> &bounds)
+{
+  const bool location_aware = m_reference.is_set();
+  const bool viewport        = !m_viewport.empty();
+
+  const size_t ids_per_query = 500;
+  for (size_t start = 0; start < ids.size(); start += ids_per_query)
+    {
+      std::ostringstream qtxt;
+      qtxt << "SELECT o.id, o.latitude, o.longitude, o.search_rank, "
+           << "h.min_latitude, h.max_latitude, h.min_longitude, h.max_longitude, "
+           << "h.min_search_rank "
+           << "FROM object_primary o LEFT JOIN hierarchy h ON o.id=h.prim_id "
+           << "WHERE o.id IN (";
+      for (size_t i = start; i < ids.size() && i < start + ids_per_query; ++i)
+        {
+          if (i > start)
+            qtxt << ",";
+          qtxt << ids[i];
+        }
+      qtxt << ")";
+
+#ifdef GEONLP_PRINT_SQL
+      std::cout << qtxt.str() << "\n";
+#endif
+      sqlite3pp::query qry(m_index->db, qtxt.str().c_str());
+      for (auto v : qry)
+        {
+          long long int id;
+          double        latitude, longitude, search_rank;
+          v.getter() >> id >> latitude >> longitude >> search_rank;
+
+          // objects without subobjects don't have hierarchy record
+          BoundingBox box;
+          double      min_search_rank = search_rank;
+          box.add(latitude, longitude);
+          if (v.column_type(4) != SQLITE_NULL)
+            v.getter(4) >> box.min_latitude >> box.max_latitude >> box.min_longitude
+                >> box.max_longitude >> min_search_rank;
+
+          BranchBounds b;
+          if (location_aware)
+            {
+              b.rank  = location_rank(search_rank, m_reference.distance(latitude, longitude));
+              b.bound = std::min(b.rank, location_rank(min_search_rank, m_reference.distance(box)));
+            }
+          if (viewport)
+            {
+              b.visible         = m_viewport.contains(latitude, longitude);
+              b.subtree_visible = b.visible || m_viewport.intersects(box);
+            }
+
+          bounds[id] = b;
+        }
+    }
+}
+
+std::string Geocoder::viewport_condition() const
+{
+  if (m_viewport.empty())
+    return std::string();
+
+  std::ostringstream qtxt;
+  qtxt.precision(10);
+  qtxt << "AND o.latitude BETWEEN " << m_viewport.min_latitude << " AND "
+       << m_viewport.max_latitude << " AND o.longitude BETWEEN " << m_viewport.min_longitude
+       << " AND " << m_viewport.max_longitude << " ";
+  return qtxt.str();
+}
+
+bool Geocoder::add_result(std::vector<GeoResult> &result, const GeoResult &r) const
+{
+  if (m_max_results == 0 || result.size() < m_max_inter_results)
+    {
+      result.push_back(r);
+      return true;
+    }
+
+  if (!m_reference.is_set() || result.empty())
+    return false;
+
+  auto worst = std::max_element(result.begin(), result.end(),
+                                [](const GeoResult &a, const GeoResult &b) {
+                                  return a.search_rank < b.search_rank;
+                                });
+  if (r.search_rank >= worst->search_rank)
+    return false;
+
+  *worst = r;
+  return true;
+}
+
+double Geocoder::worst_location_rank(const std::vector<GeoResult> &result)
+{
+  double worst = -std::numeric_limits<double>::max();
+  for (const GeoResult &r : result)
+    worst = std::max(worst, r.search_rank);
+  return worst;
+}
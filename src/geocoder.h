@@ -1,14 +1,23 @@
 #ifndef GEOCODER_H
 #define GEOCODER_H
 
+#include "geometry.h"
+#include "mappedfile.h"
 #include "postal.h"
+#include "spatialcell.h"
 
 #include <kchashdb.h>
 #include <marisa.h>
 #include <sqlite3pp.h>
 
 #include <cctype>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
 #include <string>
+#include <unordered_map>
 #include <vector>
 
 namespace GeoNLP
@@ -16,6 +25,7 @@ namespace GeoNLP
 
 class Geocoder
 {
+  friend class CorridorSearch;
 
 public:
   struct GeoResult
@@ -30,6 +40,7 @@ public:
     std::string   phone;
     std::string   postal_code;
     std::string   website;
+    std::string   database; ///< database directory, filled by GeocoderSet
     size_t        levels_resolved;
     size_t        admin_levels = 0;
     double        search_rank;
@@ -56,6 +67,14 @@ public:
     int    zoom() const { return m_zoom; }
     double importance() const { return m_importance; }
     double distance(const GeoResult &r) const;
+    double distance(double latitude, double longitude) const;
+
+    /// \brief Distance to the closest point of the bounding box
+    ///
+    /// The closest point is found by clamping the reference
+    /// coordinates into the box. This is accurate for the boxes
+    /// nearby, which is where the location bias matters.
+    double distance(const BoundingBox &box) const;
 
   private:
     double m_latitude;
@@ -65,6 +84,31 @@ public:
     bool   m_is_set;
   };
 
+  /// \brief How the database is kept in memory
+  enum Residency
+  {
+    ResidencyLoad, ///< default, as handled by the database library
+    ResidencyMap,  ///< memory mapped, pages are shared between processes
+    ResidencyLock  ///< memory mapped and locked in RAM
+  };
+
+  /// \brief Order in which the levels of the parsed query are searched
+  enum SearchStrategy
+  {
+    StrategyAuto,     ///< default, chosen for each hierarchy by the selectivity of its levels
+    StrategyTopDown,  ///< from the top level down, through the subobjects of the matches
+    StrategyBottomUp, ///< from the most selective level, checking the ancestors upward
+    StrategyMergeJoin ///< all levels at once, by merging their sorted posting lists
+  };
+
+  /// \brief Memory used by the databases, bytes
+  struct MemoryUsage
+  {
+    size_t trie     = 0;
+    size_t id_index = 0;
+    size_t primary  = 0;
+  };
+
   typedef uint32_t index_id_key;
   typedef uint32_t index_id_value;
 
@@ -79,8 +123,24 @@ public:
 
   /// \brief Search for any objects matching the normalized query
   ///
+  /// When the reference is set, the results are ranked with the
+  /// location bias applied. The bias is taken into account while
+  /// exploring the hierarchy: the branches are explored starting
+  /// from the ones that can give the best ranked results and the
+  /// exploration is stopped when none of the remaining branches can
+  /// improve the intermediate results.
+  ///
+  /// When the viewport is not empty, only the objects within it are
+  /// returned. Branches of the hierarchy that are fully outside the
+  /// viewport are not explored.
+  bool search(const ParsedQuery &parsed_query, std::vector<GeoResult> &result,
+              size_t min_levels = 0, const GeoReference &reference = GeoReference(),
+              const BoundingBox &viewport = BoundingBox());
+
+  /// \brief Search for any objects matching the map-based normalized query
   bool search(const std::vector<Postal::ParseResult> &parsed_query, std::vector<GeoResult> &result,
-              size_t min_levels = 0, const GeoReference &reference = GeoReference());
+              size_t min_levels = 0, const GeoReference &reference = GeoReference(),
+              const BoundingBox &viewport = BoundingBox());
 
   /// \brief Search for objects within given radius from specified point and matching the query
   ///
@@ -106,12 +166,22 @@ public:
   /// points from the beginning of the line when searching for
   /// objects. This, for example, is used when looking for objects
   /// next to route upcoming from the current location
+  ///
+  /// Results are given in the order along the line with the
+  /// distance measured along the line starting from the first point
+  /// that is not skipped.
+  ///
+  /// For repeated searches while moving along the line, use
+  /// CorridorSearch that keeps the search state between the calls.
   bool search_nearby(const std::vector<std::string> &name_query,
                      const std::vector<std::string> &type_query,
                      const std::vector<double> &latitude, const std::vector<double> &longitude,
                      double radius, std::vector<GeoResult> &result, Postal &postal,
                      size_t skip_points = 0);
 
+  /// \brief Check whether the normalized string is a key in the search index
+  bool has_normalized_key(const std::string &key);
+
   int  get_levels_in_title() const { return m_levels_in_title; }
   void set_levels_in_title(int l) { m_levels_in_title = l; }
 
@@ -132,6 +202,23 @@ public:
     update_limits();
   }
 
+  /// \brief Strategy used to search the hierarchies of the query
+  ///
+  /// With StrategyAuto, the number of ids in the posting lists of
+  /// each level is used to estimate its selectivity. When the search
+  /// is expected to be cheaper, it starts from the most selective
+  /// level and the matches are checked against the levels above
+  /// through their ancestors. When all levels have many candidates,
+  /// their posting lists are merged in one pass. Hierarchies are
+  /// searched top-down otherwise. Queries with postal code are not
+  /// searched by merging.
+  SearchStrategy get_search_strategy() const { return m_search_strategy; }
+  void           set_search_strategy(SearchStrategy s) { m_search_strategy = s; }
+
+  /// \brief Smallest number of candidates at each level for choosing the merge of the levels
+  size_t get_merge_join_min_candidates() const { return m_merge_join_min_candidates; }
+  void   set_merge_join_min_candidates(size_t n) { m_merge_join_min_candidates = n; }
+
   /// \brief Set preferred language for results
   ///
   /// Use two-letter coded language code as an argument. For
@@ -140,11 +227,102 @@ public:
   /// or an empty string.
   void set_result_language(const std::string &lang) { m_preferred_result_language = lang; }
 
+  /// \brief Residency of the databases in memory
+  ///
+  /// For the trie, ResidencyLoad reads it into the process memory
+  /// while ResidencyMap and ResidencyLock map the file. For the id
+  /// index and the primary SQLite database, ResidencyLoad uses the
+  /// default caches of the libraries while ResidencyMap and
+  /// ResidencyLock map the whole file. Locking requires sufficient
+  /// memory lock limits (RLIMIT_MEMLOCK). Changes are applied on the
+  /// next load or reload.
+  Residency get_trie_residency() const { return m_trie_residency; }
+  void      set_trie_residency(Residency r) { m_trie_residency = r; }
+
+  Residency get_id_index_residency() const { return m_id_index_residency; }
+  void      set_id_index_residency(Residency r) { m_id_index_residency = r; }
+
+  Residency get_primary_residency() const { return m_primary_residency; }
+  void      set_primary_residency(Residency r) { m_primary_residency = r; }
+
+  /// \brief Memory used by the loaded databases
+  ///
+  /// For the mapped files, the pages of the file that are resident
+  /// in RAM are reported. These pages are shared by all processes
+  /// using the same files. For the trie loaded into the process
+  /// memory, its size is reported. Files with ResidencyLoad are not
+  /// mapped and are reported as 0.
+  MemoryUsage get_memory_usage() const;
+
+  /// \brief Save the parts of the databases that are resident in RAM
+  ///
+  /// When saved after serving typical queries, the profile lists
+  /// the parts of the databases that are frequently accessed. It is
+  /// used by warm_up after the next load. Only the mapped databases
+  /// are included in the profile.
+  bool save_access_profile(const std::string &fname) const;
+
+  /// \brief Prefetch the databases into RAM
+  ///
+  /// Parts of the databases listed in the access profile are read
+  /// into the page cache. Without the profile, the trie is
+  /// prefetched. Files that are not mapped are prefetched using
+  /// posix_fadvise before the search index is loaded from them. When
+  /// run in background, the method returns immediately, opens the
+  /// search index in the background, and the searches can be
+  /// performed while the data is prefetched.
+  bool warm_up(const std::string &profile = std::string(), bool background = true);
+
+  /// \brief Open the databases that are opened on demand
+  ///
+  /// Trie and id index are used only by search for the normalized
+  /// query and are opened on its first call. Use this method to
+  /// open them in advance.
+  bool open_search_index();
+
+  /// \brief Close the databases that are opened on demand
+  ///
+  /// Searches in progress finish using the closed databases. They
+  /// are opened again on the next search that needs them.
+  void release_search_index();
+
+  /// \brief Open databases in the given directory
+  ///
+  /// Databases are opened while the currently loaded ones are still
+  /// used for search. When opened successfully, new databases are
+  /// published atomically and the searches started after that use
+  /// them. Searches in progress finish using the databases they
+  /// started with, old databases are closed when the last of such
+  /// searches is finished. On error, currently loaded databases are
+  /// kept.
+  ///
+  /// This method can be called from another thread than the one
+  /// used for search.
   bool load(const std::string &dbpath);
   bool load();
+
+  /// \brief Open the databases from the current directory again
+  ///
+  /// Use to pick up the new database files. The files should be
+  /// replaced by renaming new files over the old ones, not by
+  /// overwriting them in place.
+  bool reload();
+
   void drop();
 
-  operator bool() const { return m_database_open; }
+  operator bool() const { return (bool)std::atomic_load(&m_published); }
+
+  std::string get_database_path() const;
+
+  /// \brief Bounding box of the objects in the database
+  ///
+  /// Empty if the database does not record it.
+  BoundingBox get_bounding_box() const;
+
+  /// \brief libpostal country parser preferred for this database
+  ///
+  /// Recorded by the importer, empty if there is no preference.
+  std::string get_postal_country_parser() const;
 
 public:
   static std::string name_primary(const std::string &dname);
@@ -195,8 +373,16 @@ public:
                              const std::vector<double> &longitude, double reference_latitude,
                              double reference_longitude);
 
+  // search for the segment on a line that is the closest to the
+  // specified point together with the distance along the line
+  // (meters) to the projection of the point onto the segment. returns
+  // false on error
+  static bool closest_segment(const std::vector<double> &latitude,
+                              const std::vector<double> &longitude, double reference_latitude,
+                              double reference_longitude, size_t &segment, double &offset);
+
 protected:
-  bool search(const Postal::Hierarchy &parsed, const std::string &postal_code,
+  bool search(const ParsedQuery::Hierarchy &parsed, const std::string &postal_code,
               std::vector<GeoResult> &result, size_t level = 0, long long int range0 = 0,
               long long int range1 = 0);
 
@@ -209,21 +395,219 @@ protected:
 
   void get_features(GeoResult &r);
 
-  virtual bool check_version();
+  // databases used only by the search for the normalized query:
+  // trie of normalized strings and index of object ids for them
+  struct SearchIndex
+  {
+    MappedFile           norm_id_file;
+    MappedFile           trie_file;
+    kyotocabinet::HashDB norm_id;
+    marisa::Trie         trie;
+  };
+
+  // set of databases used for search. it is opened and published
+  // as a whole, and kept alive while used by search. search index
+  // is opened on the first use
+  struct Index
+  {
+    std::string         path;
+    MappedFile          primary_file;
+    sqlite3pp::database db;
+    BoundingBox         bounding_box;
+    std::string         postal_country_parser;
+
+    Residency trie_residency;
+    Residency id_index_residency;
+
+    std::mutex                   search_mutex;
+    std::shared_ptr<SearchIndex> search; ///< guarded by search_mutex
+  };
+
+  // keeps the published index in m_index while searching. when
+  // requested, search index is opened and kept in m_search_index.
+  // when nested, the indexes of the outer search are used
+  class IndexLock
+  {
+  public:
+    IndexLock(Geocoder &geocoder, bool search_index = false);
+    ~IndexLock();
+
+    operator bool() const { return m_ok; }
+
+  private:
+    Geocoder                    &m_geocoder;
+    std::shared_ptr<Index>       m_previous;
+    std::shared_ptr<SearchIndex> m_previous_search;
+    bool                         m_ok;
+  };
+
+  std::shared_ptr<Index> open(const std::string &dbpath);
+
+  // search index of the given index, opened if needed
+  static std::shared_ptr<SearchIndex> search_index(Index &index);
+
+  // currently opened search index of the published index, if any
+  std::shared_ptr<SearchIndex> opened_search_index() const;
+
+  virtual bool check_version(sqlite3pp::database &db);
 
-  bool check_version(const std::string &supported);
+  bool check_version(sqlite3pp::database &db, const std::string &supported);
 
   void update_limits();
 
+  static BoundingBox load_bounding_box(sqlite3pp::database &db);
+  static std::string load_postal_country_parser(sqlite3pp::database &db);
+
   static double search_rank_location_bias(double distance, int zoom = 16);
 
+  // search rank with the location bias of the current search
+  // reference applied
+  double location_rank(double search_rank, double distance) const;
+
+  // help structure with the location ranks and visibility of the
+  // search branches
+  struct BranchBounds
+  {
+    double bound           = 0;    ///< lower bound of location rank in the branch
+    double rank            = 0;    ///< location rank of the object itself
+    bool   visible         = true; ///< object is within the viewport
+    bool   subtree_visible = true; ///< object or some of its subobjects are within the viewport
+  };
+
+  // help structure keeping marisa-found search string with found ids
+  struct IntermediateResult
+  {
+    std::string    txt;
+    index_id_value id;
+    double         bound   = 0;    ///< lower bound of location rank in the branch
+    double         rank    = 0;    ///< location rank of the object itself
+    bool           visible = true; ///< object itself is within the viewport
+    IntermediateResult(const std::string &t, index_id_value i) : txt(t), id(i) {}
+    bool operator<(const IntermediateResult &A) const
+    {
+      return (txt.length() < A.txt.length() || (txt.length() == A.txt.length() && txt < A.txt)
+              || (txt == A.txt && id < A.id));
+    }
+  };
+
+  typedef std::deque<IntermediateResult> Branches;
+
+  // ids in the posting lists of a level together with the length of
+  // the shortest trie key matching each of them. shorter keys are
+  // better matches, as in the order of IntermediateResult
+  struct LevelIds
+  {
+    std::vector<index_id_value> ids;        ///< sorted
+    std::vector<size_t>         key_length; ///< for each of ids
+  };
+
+  // lookups made while searching for one query. the same expansions
+  // and subtrees are met in several hierarchies and levels, so the
+  // lookups are shared between them
+  struct SearchMemo
+  {
+    struct Key
+    {
+      bool        found = false;
+      std::string key;
+      std::string postings; ///< ids as stored in the id index
+    };
+
+    std::unordered_map<std::string, std::vector<size_t> > trie; ///< expansion -> trie key ids
+    std::unordered_map<size_t, Key>                       keys; ///< trie key id -> key
+
+    ///< level expansions and parent range -> sorted and filtered branches
+    std::unordered_map<std::string, std::shared_ptr<const Branches> > branches;
+
+    ///< level expansions -> sorted ids in the posting lists
+    std::unordered_map<std::string, std::shared_ptr<const LevelIds> > level_ids;
+
+    std::unordered_map<long long int, long long int> last_subobject;
+    std::unordered_map<long long int, std::string>   postal_code;
+
+    void clear();
+  };
+
+  // ids of trie keys starting with the expansion, memoized
+  const std::vector<size_t> &memo_trie(const std::string &expansion);
+
+  // branches of the search at the given level and parent range, memoized
+  std::shared_ptr<const Branches> memo_branches(const ParsedQuery::Hierarchy &parsed, size_t level,
+                                                long long int range0, long long int range1,
+                                                bool full_range);
+
+  // number of ids in the posting lists of the level, memoized
+  static std::string level_key(const ParsedQuery::Hierarchy &parsed, size_t level);
+  size_t             level_postings(const ParsedQuery::Hierarchy &parsed, size_t level);
+
+  // ids in the posting lists of the level, memoized
+  std::shared_ptr<const LevelIds> level_ids(const ParsedQuery::Hierarchy &parsed, size_t level);
+
+  long long int memo_last_subobject(long long int id);
+  void          memo_last_subobjects(const std::vector<index_id_value> &ids);
+  std::string   memo_postal_code(long long int id);
+
+  // explore the branch found at the level: search for its subobjects
+  // matching the next levels or add it to the results
+  void search_branch(const ParsedQuery::Hierarchy &parsed, const std::string &postal_code,
+                     std::vector<GeoResult> &result, size_t level,
+                     const IntermediateResult &branch);
+
+  // choose the strategy for the hierarchy. for bottom-up search,
+  // the level to start from is given
+  SearchStrategy plan(const ParsedQuery::Hierarchy &parsed, const std::string &postal_code,
+                      size_t &start_level);
+
+  // search starting from the candidates of the given level, checking
+  // that their ancestors match the levels above
+  bool search_bottom_up(const ParsedQuery::Hierarchy &parsed, const std::string &postal_code,
+                        std::vector<GeoResult> &result, size_t level);
+
+  // search all levels at once by merging their sorted posting lists.
+  // the objects nested in a match of the level above are matches of
+  // the next level. open intervals of the matches are kept in a stack
+  bool search_merge_join(const ParsedQuery::Hierarchy &parsed, std::vector<GeoResult> &result);
+
+  // check whether the ancestors of the object match the levels above
+  // the given one. postal_is_ok is set if any of the matched
+  // ancestors has the postal code
+  bool match_ancestors(const ParsedQuery::Hierarchy &parsed, size_t level, long long int id,
+                       const std::string &postal_code, bool &postal_is_ok);
+
+  // fill location ranks and visibility of the objects and their
+  // subobjects. objects missing in the database are not inserted
+  void branch_bounds(const std::vector<long long int>     &ids,
+                     std::map<long long int, BranchBounds> &bounds);
+
+  // SQL condition selecting objects from object_primary (aliased as
+  // o) that are within the viewport
+  std::string viewport_condition() const;
+
+  // add intermediate result. when the results are full and the
+  // location bias is used, the result replaces the worst one if it
+  // is better than that
+  bool add_result(std::vector<GeoResult> &result, const GeoResult &r) const;
+
+  // location rank of the worst intermediate result
+  static double worst_location_rank(const std::vector<GeoResult> &result);
+
+  // SQL condition selecting objects from object_primary (aliased as
+  // o) with the cell ids within the given ranges
+  static std::string cell_condition(const std::vector<SpatialCell::Range> &ranges);
+
+  // check whether any of the names matches name query after
+  // normalization and expansion of the names
+  static bool name_matches(const std::vector<std::string> &name_query,
+                           const std::set<std::string> &names, Postal &postal);
+
 protected:
-  sqlite3pp::database m_db;
-  std::string         m_database_path;
-  bool                m_database_open = false;
+  std::shared_ptr<Index> m_published; ///< index used by new searches, accessed atomically
+  std::shared_ptr<Index>       m_index;        ///< index used by the current search
+  std::shared_ptr<SearchIndex> m_search_index; ///< search index used by the current search
 
-  kyotocabinet::HashDB m_database_norm_id;
-  marisa::Trie         m_trie_norm;
+  Residency m_trie_residency     = ResidencyLoad;
+  Residency m_id_index_residency = ResidencyLoad;
+  Residency m_primary_residency  = ResidencyLoad;
 
   int    m_levels_in_title           = 2;
   size_t m_max_queries_per_hierarchy = 0;
@@ -231,8 +615,14 @@ protected:
   size_t m_max_inter_offset          = 100;
   size_t m_max_inter_results;
 
-  size_t m_levels_resolved;
-  size_t m_query_count;
+  SearchStrategy m_search_strategy           = StrategyAuto;
+  size_t         m_merge_join_min_candidates = 1000;
+
+  size_t       m_levels_resolved;
+  size_t       m_query_count;
+  GeoReference m_reference;
+  BoundingBox  m_viewport;
+  SearchMemo   m_memo;
 
   std::string m_preferred_result_language;
 };
@@ -0,0 +1,177 @@
+#include "geocoderset.h"
+
+#include <algorithm>
+#include <future>
+#include <iostream>
+#include <map>
+#include <set>
+
+using namespace GeoNLP;
+
+bool GeocoderSet::add(const std::string &dbpath)
+{
+  std::unique_ptr<Geocoder> geocoder(new Geocoder());
+  if (!geocoder->load(dbpath))
+    {
+      std::cerr << "GeocoderSet: error loading " << dbpath << std::endl;
+      return false;
+    }
+
+  geocoder->set_max_results(m_max_results);
+  geocoder->set_levels_in_title(m_levels_in_title);
+  geocoder->set_max_queries_per_hierarchy(m_max_queries_per_hierarchy);
+  geocoder->set_max_intermediate_offset(m_max_inter_offset);
+  geocoder->set_result_language(m_result_language);
+  m_geocoders.push_back(std::move(geocoder));
+  return true;
+}
+
+void GeocoderSet::set_max_results(size_t mx)
+{
+  m_max_results = mx;
+  for (auto &g : m_geocoders)
+    g->set_max_results(mx);
+}
+
+void GeocoderSet::set_levels_in_title(int l)
+{
+  m_levels_in_title = l;
+  for (auto &g : m_geocoders)
+    g->set_levels_in_title(l);
+}
+
+void GeocoderSet::set_max_queries_per_hierarchy(size_t mx)
+{
+  m_max_queries_per_hierarchy = mx;
+  for (auto &g : m_geocoders)
+    g->set_max_queries_per_hierarchy(mx);
+}
+
+void GeocoderSet::set_max_intermediate_offset(size_t mx)
+{
+  m_max_inter_offset = mx;
+  for (auto &g : m_geocoders)
+    g->set_max_intermediate_offset(mx);
+}
+
+void GeocoderSet::set_result_language(const std::string &lang)
+{
+  m_result_language = lang;
+  for (auto &g : m_geocoders)
+    g->set_result_language(lang);
+}
+
+std::vector<Geocoder *> GeocoderSet::select(const Geocoder::GeoReference &reference,
+                                            const BoundingBox            &viewport) const
+{
+  // databases without recorded bounding box are always selected
+  std::vector<Geocoder *> selected;
+  for (auto &g : m_geocoders)
+    {
+      const BoundingBox &bbox = g->get_bounding_box();
+      if (!viewport.empty() && !bbox.empty() && !bbox.intersects(viewport))
+        continue;
+      selected.push_back(g.get());
+    }
+
+  if (reference.is_set())
+    {
+      std::vector<Geocoder *> near;
+      for (Geocoder *g : selected)
+        if (g->get_bounding_box().empty()
+            || reference.distance(g->get_bounding_box()) <= m_reference_radius)
+          near.push_back(g);
+      if (!near.empty())
+        selected.swap(near);
+    }
+
+  return selected;
+}
+
+bool GeocoderSet::search(const std::vector<Postal::ParseResult> &parsed_query,
+                         std::vector<Geocoder::GeoResult> &result, size_t min_levels,
+                         const Geocoder::GeoReference &reference, const BoundingBox &viewport)
+{
+  std::vector<std::pair<Geocoder *, const std::vector<Postal::ParseResult> *> > queries;
+  for (Geocoder *g : select(reference, viewport))
+    queries.push_back(std::make_pair(g, &parsed_query));
+
+  search(queries, result, min_levels, reference, viewport);
+  return true;
+}
+
+bool GeocoderSet::search(const std::string &query, PostalPool &postal,
+                         std::vector<Geocoder::GeoResult> &result, size_t min_levels,
+                         const Geocoder::GeoReference &reference, const BoundingBox &viewport)
+{
+  std::vector<Geocoder *> selected = select(reference, viewport);
+
+  // parse once for each country, in parallel. parsers of all
+  // countries are acquired together to avoid evicting each other
+  std::set<std::string> countries;
+  for (Geocoder *g : selected)
+    countries.insert(g->get_postal_country_parser());
+
+  std::map<std::string, std::future<PostalService::ParseReply> > parsing
+      = postal.parse(countries, query);
+
+  std::map<std::string, PostalService::ParseReply> parsed;
+  for (auto &p : parsing)
+    parsed[p.first] = p.second.get();
+
+  bool ok = true;
+  std::vector<std::pair<Geocoder *, const std::vector<Postal::ParseResult> *> > queries;
+  for (Geocoder *g : selected)
+    {
+      const PostalService::ParseReply &reply = parsed[g->get_postal_country_parser()];
+      if (reply.ok)
+        queries.push_back(std::make_pair(g, &reply.parsed));
+      else
+        ok = false;
+    }
+
+  search(queries, result, min_levels, reference, viewport);
+  return ok;
+}
+
+void GeocoderSet::search(
+    const std::vector<std::pair<Geocoder *, const std::vector<Postal::ParseResult> *> > &queries,
+    std::vector<Geocoder::GeoResult> &result, size_t min_levels,
+    const Geocoder::GeoReference &reference, const BoundingBox &viewport)
+{
+  result.clear();
+
+  // search in parallel, each database has its own Geocoder
+  auto search_database = [&](Geocoder *g, const std::vector<Postal::ParseResult> *parsed_query) {
+    std::vector<Geocoder::GeoResult> r;
+    if (g->search(*parsed_query, r, min_levels, reference, viewport))
+      for (Geocoder::GeoResult &i : r)
+        i.database = g->get_database_path();
+    return r;
+  };
+
+  std::vector<std::future<std::vector<Geocoder::GeoResult> > > searches;
+  for (const auto &q : queries)
+    searches.push_back(std::async(std::launch::async, search_database, q.first, q.second));
+  // merge keeping only results with the largest number of resolved levels
+  size_t levels_resolved = 0;
+  for (auto &s : searches)
+    {
+      std::vector<Geocoder::GeoResult> r = s.get();
+      for (Geocoder::GeoResult &i : r)
+        {
+          if (i.levels_resolved < levels_resolved)
+            continue;
+          if (i.levels_resolved > levels_resolved)
+            {
+              result.clear();
+              levels_resolved = i.levels_resolved;
+            }
+          result.push_back(i);
+        }
+    }
+
+  std::sort(result.begin(), result.end());
+  if (m_max_results > 0 && result.size() >= m_max_results)
+    result.resize(m_max_results);
+}
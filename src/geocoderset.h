@@ -0,0 +1,106 @@
+#ifndef GEOCODER_GEOCODERSET_H
+#define GEOCODER_GEOCODERSET_H
+
+#include "geocoder.h"
+#include "geometry.h"
+#include "postal.h"
+#include "postalpool.h"
+
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace GeoNLP
+{
+
+/// \brief Search across several databases
+///
+/// GeocoderSet keeps a Geocoder for each of the database directories,
+/// as when the data is split by countries or regions. Search is
+/// performed in the databases that are selected using their bounding
+/// boxes, in parallel, and the results are merged into one list. Each
+/// result has the database directory it was found in.
+///
+/// The same GeocoderSet should not be searched from several threads
+/// at the same time.
+class GeocoderSet
+{
+public:
+  GeocoderSet() {}
+
+  /// \brief Open database and add it to the set
+  bool add(const std::string &dbpath);
+
+  void   clear() { m_geocoders.clear(); }
+  size_t size() const { return m_geocoders.size(); }
+
+  /// \brief Search for any objects matching the normalized query
+  ///
+  /// Without reference and viewport, all databases are searched.
+  /// With the viewport, only the databases intersecting it are
+  /// searched. With the reference, the databases that are within
+  /// the reference radius from the reference location are searched
+  /// or, if there are no such databases, all of them.
+  ///
+  /// As in Geocoder::search, only the results with the largest number
+  /// of resolved levels are kept.
+  bool search(const std::vector<Postal::ParseResult> &parsed_query,
+              std::vector<Geocoder::GeoResult> &result, size_t min_levels = 0,
+              const Geocoder::GeoReference &reference = Geocoder::GeoReference(),
+              const BoundingBox            &viewport  = BoundingBox());
+
+  /// \brief Parse the query and search for any objects matching it
+  ///
+  /// The query is parsed for each of the selected databases by the
+  /// country parser recorded in the database. Query is parsed once
+  /// for each country. Selection of the databases and merging of the
+  /// results is as in the search of the parsed query.
+  bool search(const std::string &query, PostalPool &postal,
+              std::vector<Geocoder::GeoResult> &result, size_t min_levels = 0,
+              const Geocoder::GeoReference &reference = Geocoder::GeoReference(),
+              const BoundingBox            &viewport  = BoundingBox());
+
+  /// \brief Distance in meters from the reference to the databases that are searched
+  double get_reference_radius() const { return m_reference_radius; }
+  void   set_reference_radius(double radius) { m_reference_radius = radius; }
+
+  size_t get_max_results() const { return m_max_results; }
+  void   set_max_results(size_t mx);
+
+  // settings are applied to all databases, including the ones added later
+  int  get_levels_in_title() const { return m_levels_in_title; }
+  void set_levels_in_title(int l);
+
+  size_t get_max_queries_per_hierarchy() const { return m_max_queries_per_hierarchy; }
+  void   set_max_queries_per_hierarchy(size_t mx);
+
+  size_t get_max_intermediate_offset() const { return m_max_inter_offset; }
+  void   set_max_intermediate_offset(size_t mx);
+
+  const std::string &get_result_language() const { return m_result_language; }
+  void               set_result_language(const std::string &lang);
+
+protected:
+  std::vector<Geocoder *> select(const Geocoder::GeoReference &reference,
+                                 const BoundingBox            &viewport) const;
+
+  // search each database with its parsed query and merge the results
+  void search(const std::vector<std::pair<Geocoder *, const std::vector<Postal::ParseResult> *> >
+                                                &queries,
+              std::vector<Geocoder::GeoResult> &result, size_t min_levels,
+              const Geocoder::GeoReference &reference, const BoundingBox &viewport);
+
+protected:
+  std::vector<std::unique_ptr<Geocoder> > m_geocoders;
+
+  double      m_reference_radius          = 50e3;
+  size_t      m_max_results               = 25;
+  int         m_levels_in_title           = 2;
+  size_t      m_max_queries_per_hierarchy = 0;
+  size_t      m_max_inter_offset          = 100;
+  std::string m_result_language;
+};
+
+}
+
+#endif // GEOCODER_GEOCODERSET_H
@@ -0,0 +1,88 @@
+#ifndef GEOCODER_GEOMETRY_H
+#define GEOCODER_GEOMETRY_H
+
+#include <algorithm>
+#include <cmath>
+
+namespace GeoNLP
+{
+
+// rough estimates of distance (meters) per degree
+inline double distance_per_latitude()
+{
+  return 111e3;
+}
+
+inline double distance_per_longitude(double latitude)
+{
+  return std::max(1000.0, M_PI / 180.0 * 6378137.0 * cos(latitude * M_PI / 180.0));
+}
+
+/// \brief Bounding box given by WGS 84 coordinates
+struct BoundingBox
+{
+  double min_latitude  = 0;
+  double max_latitude  = -1;
+  double min_longitude = 0;
+  double max_longitude = -1;
+
+  BoundingBox() {}
+  BoundingBox(double min_lat, double max_lat, double min_lon, double max_lon)
+      : min_latitude(min_lat), max_latitude(max_lat), min_longitude(min_lon),
+        max_longitude(max_lon)
+  {
+  }
+
+  bool empty() const { return min_latitude > max_latitude || min_longitude > max_longitude; }
+
+  void add(double latitude, double longitude)
+  {
+    if (empty())
+      {
+        min_latitude = max_latitude = latitude;
+        min_longitude = max_longitude = longitude;
+        return;
+      }
+    min_latitude  = std::min(min_latitude, latitude);
+    max_latitude  = std::max(max_latitude, latitude);
+    min_longitude = std::min(min_longitude, longitude);
+    max_longitude = std::max(max_longitude, longitude);
+  }
+
+  void add(const BoundingBox &b)
+  {
+    if (b.empty())
+      return;
+    add(b.min_latitude, b.min_longitude);
+    add(b.max_latitude, b.max_longitude);
+  }
+
+  bool contains(double latitude, double longitude) const
+  {
+    return min_latitude <= latitude && latitude <= max_latitude && min_longitude <= longitude
+           && longitude <= max_longitude;
+  }
+
+  bool intersects(const BoundingBox &b) const
+  {
+    return !empty() && !b.empty() && min_latitude <= b.max_latitude
+           && b.min_latitude <= max_latitude && min_longitude <= b.max_longitude
+           && b.min_longitude <= max_longitude;
+  }
+
+  /// \brief Expand the box by the given distance in meters
+  BoundingBox expanded(double distance) const
+  {
+    if (empty())
+      return *this;
+    const double lat  = std::max(std::fabs(min_latitude), std::fabs(max_latitude));
+    const double dlat = distance / distance_per_latitude();
+    const double dlon = distance / distance_per_longitude(lat);
+    return BoundingBox(min_latitude - dlat, max_latitude + dlat, min_longitude - dlon,
+                       max_longitude + dlon);
+  }
+};
+
+}
+
+#endif // GEOCODER_GEOMETRY_H
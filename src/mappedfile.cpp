@@ -0,0 +1,175 @@
+#include "mappedfile.h"
+
+#include <algorithm>
+#include <fcntl.h>
+#include <iostream>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+
+using namespace GeoNLP;
+
+MappedFile::~MappedFile()
+{
+  close();
+}
+
+bool MappedFile::open(const std::string &fname)
+{
+  close();
+
+  int fd = ::open(fname.c_str(), O_RDONLY);
+  if (fd < 0)
+    {
+      std::cerr << "MappedFile: error opening " << fname << "\n";
+      return false;
+    }
+
+  struct stat st;
+  if (fstat(fd, &st) != 0 || st.st_size == 0)
+    {
+      std::cerr << "MappedFile: error getting size of " << fname << "\n";
+      ::close(fd);
+      return false;
+    }
+
+  void *data = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  ::close(fd); // mapping stays valid after closing the file
+
+  if (data == MAP_FAILED)
+    {
+      std::cerr << "MappedFile: error mapping " << fname << "\n";
+      return false;
+    }
+
+  m_data = data;
+  m_size = st.st_size;
+  return true;
+}
+
+void MappedFile::close()
+{
+  if (!m_data)
+    return;
+
+  if (m_locked)
+    munlock(m_data, m_size);
+  munmap(m_data, m_size);
+
+  m_data   = nullptr;
+  m_size   = 0;
+  m_locked = false;
+}
+
+bool MappedFile::lock()
+{
+  if (!m_data)
+    return false;
+  if (m_locked)
+    return true;
+
+  if (mlock(m_data, m_size) != 0)
+    {
+      std::cerr << "MappedFile: error locking " << m_size
+                << " bytes in RAM, check memory lock limits\n";
+      return false;
+    }
+
+  m_locked = true;
+  return true;
+}
+
+bool MappedFile::residency(std::vector<unsigned char> &vec) const
+{
+  if (!m_data)
+    return false;
+
+  const size_t page = sysconf(_SC_PAGESIZE);
+  vec.resize((m_size + page - 1) / page);
+  return mincore(m_data, m_size, vec.data()) == 0;
+}
+
+size_t MappedFile::resident() const
+{
+  std::vector<unsigned char> vec;
+  if (!residency(vec))
+    return 0;
+
+  size_t count = 0;
+  for (unsigned char v : vec)
+    if (v & 1)
+      ++count;
+
+  return std::min(count * (size_t)sysconf(_SC_PAGESIZE), m_size);
+}
+
+std::vector<std::pair<size_t, size_t> > MappedFile::resident_ranges() const
+{
+  std::vector<std::pair<size_t, size_t> > ranges;
+  std::vector<unsigned char>              vec;
+  if (!residency(vec))
+    return ranges;
+
+  const size_t page = sysconf(_SC_PAGESIZE);
+  for (size_t i = 0; i < vec.size(); ++i)
+    {
+      if (!(vec[i] & 1))
+        continue;
+
+      const size_t offset = i * page;
+      if (!ranges.empty() && ranges.back().first + ranges.back().second == offset)
+        ranges.back().second += page;
+      else
+        ranges.push_back(std::make_pair(offset, page));
+    }
+
+  // last page can be partial
+  if (!ranges.empty() && ranges.back().first + ranges.back().second > m_size)
+    ranges.back().second = m_size - ranges.back().first;
+
+  return ranges;
+}
+
+void MappedFile::prefetch(size_t offset, size_t length, bool touch) const
+{
+  if (!m_data || offset >= m_size)
+    return;
+
+  // madvise requires page aligned address
+  const size_t page  = sysconf(_SC_PAGESIZE);
+  const size_t start = offset - offset % page;
+  const size_t end   = length == 0 ? m_size : std::min(m_size, offset + length);
+  char        *base  = (char *)m_data;
+
+  madvise(base + start, end - start, MADV_WILLNEED);
+
+  if (touch)
+    {
+      volatile char c = 0;
+      for (size_t i = start; i < end; i += page)
+        c = c + base[i];
+    }
+}
+
+bool MappedFile::prefetch(const std::string &fname, size_t offset, size_t length)
+{
+  int fd = ::open(fname.c_str(), O_RDONLY);
+  if (fd < 0)
+    {
+      std::cerr << "MappedFile: error opening " << fname << "\n";
+      return false;
+    }
+
+  // pages stay in the page cache after closing the file
+  const int err = posix_fadvise(fd, offset, length, POSIX_FADV_WILLNEED);
+  ::close(fd);
+
+  if (err != 0)
+    {
+      std::cerr << "MappedFile: error prefetching " << fname << "\n";
+      return false;
+    }
+
+  return true;
+}
@@ -0,0 +1,64 @@
+#ifndef GEOCODER_MAPPEDFILE_H
+#define GEOCODER_MAPPEDFILE_H
+
+#include <cstddef>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace GeoNLP
+{
+
+/// \brief Read-only memory mapped file
+///
+/// File is mapped as shared, so the pages are shared with the other
+/// processes mapping the same file through the page cache.
+class MappedFile
+{
+public:
+  MappedFile() {}
+  ~MappedFile();
+
+  MappedFile(const MappedFile &) = delete;
+  MappedFile &operator=(const MappedFile &) = delete;
+
+  bool open(const std::string &fname);
+  void close();
+
+  /// \brief Lock the pages of the file in RAM
+  bool lock();
+
+  /// \brief Number of bytes of the file that are resident in RAM
+  size_t resident() const;
+
+  /// \brief Ranges (offset, length) of the file that are resident in RAM
+  std::vector<std::pair<size_t, size_t> > resident_ranges() const;
+
+  /// \brief Ask the kernel to read the range of the file into RAM
+  ///
+  /// When touch is set, the pages are read before returning. Zero
+  /// length requests the range till the end of the file.
+  void prefetch(size_t offset, size_t length, bool touch = false) const;
+
+  /// \brief Ask the kernel to read the range of the file that is not mapped into the page cache
+  ///
+  /// Zero length requests the range till the end of the file.
+  static bool prefetch(const std::string &fname, size_t offset, size_t length);
+
+  const void *data() const { return m_data; }
+  size_t      size() const { return m_size; }
+
+  operator bool() const { return m_data != nullptr; }
+
+protected:
+  bool residency(std::vector<unsigned char> &vec) const;
+
+protected:
+  void  *m_data   = nullptr;
+  size_t m_size   = 0;
+  bool   m_locked = false;
+};
+
+}
+
+#endif // GEOCODER_MAPPEDFILE_H
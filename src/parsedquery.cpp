@@ -0,0 +1,172 @@
+#include "parsedquery.h"
+#include "postal.h"
+
+#include <cstdlib>
+#include <cstring>
+
+using namespace GeoNLP;
+
+#define PRIMITIVE_ADDRESS_PARSER_KEY_PREFIX "h-"
+
+// libpostal labels and the keys used by the primitive parser, in
+// the order of Label
+static const char *const label_names[ParsedQuery::LabelCount] = {
+  "house",
+  "category",
+  "near",
+  "house_number",
+  "road",
+  "unit",
+  "level",
+  "staircase",
+  "entrance",
+  "po_box",
+  "postcode",
+  "suburb",
+  "city_district",
+  "city",
+  "island",
+  "state_district",
+  "state",
+  "country_region",
+  "country",
+  "world_region",
+  "h-postcode"
+};
+
+// order of the labels in the hierarchy, top level first
+static const ParsedQuery::Label hierarchy_labels[]
+    = { ParsedQuery::Country,       ParsedQuery::CountryRegion, ParsedQuery::State,
+        ParsedQuery::StateDistrict, ParsedQuery::Island,        ParsedQuery::City,
+        ParsedQuery::CityDistrict,  ParsedQuery::Suburb,        ParsedQuery::Road,
+        ParsedQuery::HouseNumber,   ParsedQuery::Category,      ParsedQuery::House };
+
+void ParsedQuery::clear()
+{
+  m_pool.clear();
+  m_results.clear();
+}
+
+ParsedQuery::Span ParsedQuery::store(const std::vector<std::string> &v)
+{
+  Span s;
+  s.begin = m_pool.size();
+  m_pool.insert(m_pool.end(), v.begin(), v.end());
+  s.end = m_pool.size();
+  return s;
+}
+
+void ParsedQuery::add(Label label, const std::vector<std::string> &expansions)
+{
+  if (m_results.empty())
+    add_result();
+  m_results.back().labels[label] = store(expansions);
+}
+
+void ParsedQuery::add_primitive(const std::vector<std::string> &expansions)
+{
+  if (m_results.empty())
+    add_result();
+  m_results.back().primitive.push_back(store(expansions));
+}
+
+ParsedQuery::Expansions ParsedQuery::expansions(const Span &span) const
+{
+  const std::string *first = m_pool.data() + span.begin;
+  return Expansions(first, first + span.size());
+}
+
+void ParsedQuery::hierarchies(std::vector<Hierarchy> &h, std::string &postal_code) const
+{
+  h.clear();
+  for (const Result &r : m_results)
+    {
+      Hierarchy h_result;
+      for (Label l : hierarchy_labels)
+        if (!r.labels[l].empty())
+          h_result.push_back(expansions(r.labels[l]));
+
+      if (postal_code.empty() && !r.labels[PostalCode].empty())
+        postal_code = Postal::normalize_postalcode(m_pool[r.labels[PostalCode].begin]);
+
+      // primitive expansion result
+      if (h_result.empty())
+        for (const Span &s : r.primitive)
+          h_result.push_back(expansions(s));
+
+      // overwrite with the primitive parser postal code if needed
+      if (!r.labels[PrimitivePostalCode].empty())
+        postal_code = Postal::normalize_postalcode(m_pool[r.labels[PrimitivePostalCode].begin]);
+
+      h.push_back(h_result);
+    }
+}
+
+void ParsedQuery::from_parse_results(const std::vector<ParseResult> &p)
+{
+  for (const ParseResult &r : p)
+    {
+      add_result();
+
+      std::map<size_t, const std::vector<std::string> *> primitive;
+      for (const auto &i : r)
+        {
+          Label label;
+          if (label_from_name(i.first, label))
+            add(label, i.second);
+          else if (i.first.compare(0, strlen(PRIMITIVE_ADDRESS_PARSER_KEY_PREFIX),
+                                   PRIMITIVE_ADDRESS_PARSER_KEY_PREFIX)
+                   == 0)
+            {
+              const char *index = i.first.c_str() + strlen(PRIMITIVE_ADDRESS_PARSER_KEY_PREFIX);
+              char       *end;
+              size_t      level = strtoul(index, &end, 10);
+              if (end != index && *end == 0)
+                primitive[level] = &i.second;
+            }
+        }
+
+      // primitive levels are used until the first missing one
+      for (size_t level = 0; primitive.count(level); ++level)
+        add_primitive(*primitive[level]);
+    }
+}
+
+void ParsedQuery::to_parse_results(std::vector<ParseResult> &p) const
+{
+  for (const Result &r : m_results)
+    {
+      ParseResult pr;
+      for (size_t l = 0; l < LabelCount; ++l)
+        if (!r.labels[l].empty())
+          {
+            Expansions e = expansions(r.labels[l]);
+            pr[label_names[l]].assign(e.begin(), e.end());
+          }
+
+      for (size_t level = 0; level < r.primitive.size(); ++level)
+        {
+          Expansions e = expansions(r.primitive[level]);
+          pr[PRIMITIVE_ADDRESS_PARSER_KEY_PREFIX + std::to_string(level)].assign(e.begin(),
+                                                                                  e.end());
+        }
+
+      p.push_back(pr);
+    }
+}
+
+const char *ParsedQuery::label_name(Label label)
+{
+  return label < LabelCount ? label_names[label] : "";
+}
+
+bool ParsedQuery::label_from_name(const std::string &name, Label &label)
+{
+  for (size_t l = 0; l < LabelCount; ++l)
+    if (name == label_names[l])
+      {
+        label = (Label)l;
+        return true;
+      }
+  return false;
+}
@@ -0,0 +1,131 @@
+#ifndef GEOCODER_PARSEDQUERY_H
+#define GEOCODER_PARSEDQUERY_H
+
+#include <array>
+#include <cstdint>
+#include <map>
+#include <string>
+#include <vector>
+
+namespace GeoNLP
+{
+
+/// \brief Parsed and normalized query with the components indexed by label
+///
+/// Query consists of parse results, one for each parser run. Each
+/// result keeps its components in a fixed array indexed by Label
+/// and the levels of primitive parser in the order of the input.
+/// Expansions of all components are stored in one string pool and
+/// the results refer to the ranges in it, so the results and the
+/// hierarchies made of them do not copy the strings.
+///
+/// Map-based ParseResult is supported through the conversion
+/// functions.
+class ParsedQuery
+{
+public:
+  enum Label
+  {
+    House,
+    Category,
+    Near,
+    HouseNumber,
+    Road,
+    Unit,
+    Level,
+    Staircase,
+    Entrance,
+    PoBox,
+    PostalCode,
+    Suburb,
+    CityDistrict,
+    City,
+    Island,
+    StateDistrict,
+    State,
+    CountryRegion,
+    Country,
+    WorldRegion,
+    PrimitivePostalCode,
+    LabelCount
+  };
+
+  typedef std::map<std::string, std::vector<std::string> > ParseResult;
+
+  /// \brief Range of the component expansions in the string pool
+  struct Span
+  {
+    uint32_t begin = 0;
+    uint32_t end   = 0;
+
+    bool   empty() const { return begin == end; }
+    size_t size() const { return end - begin; }
+  };
+
+  /// \brief Expansions of a component
+  ///
+  /// Refers to the string pool and is valid until the query is modified.
+  class Expansions
+  {
+  public:
+    Expansions(const std::string *first, const std::string *last) : m_first(first), m_last(last)
+    {
+    }
+
+    const std::string *begin() const { return m_first; }
+    const std::string *end() const { return m_last; }
+    size_t             size() const { return m_last - m_first; }
+    bool               empty() const { return m_first == m_last; }
+    const std::string &operator[](size_t i) const { return m_first[i]; }
+
+  private:
+    const std::string *m_first;
+    const std::string *m_last;
+  };
+
+  struct Result
+  {
+    std::array<Span, LabelCount> labels;
+    std::vector<Span>            primitive; ///< primitive parser levels, top level first
+  };
+
+  typedef std::vector<Expansions> Hierarchy;
+
+public:
+  void clear();
+
+  size_t        size() const { return m_results.size(); }
+  bool          empty() const { return m_results.empty(); }
+  const Result &operator[](size_t i) const { return m_results[i]; }
+
+  /// \brief Start new result, the components are added to the last result
+  void add_result() { m_results.push_back(Result()); }
+  void add(Label label, const std::vector<std::string> &expansions);
+  void add_primitive(const std::vector<std::string> &expansions);
+
+  Expansions expansions(const Span &span) const;
+
+  /// \brief Hierarchies of the results and the normalized postal code
+  ///
+  /// Postal code is taken from the first result that has it, unless
+  /// it is given in the primitive parser result.
+  void hierarchies(std::vector<Hierarchy> &h, std::string &postal_code) const;
+
+  /// \brief Conversion from and to map-based results, results are appended
+  void from_parse_results(const std::vector<ParseResult> &p);
+  void to_parse_results(std::vector<ParseResult> &p) const;
+
+  static const char *label_name(Label label);
+  static bool        label_from_name(const std::string &name, Label &label);
+
+protected:
+  Span store(const std::vector<std::string> &v);
+
+protected:
+  std::vector<std::string> m_pool;
+  std::vector<Result>      m_results;
+};
+
+}
+
+#endif // GEOCODER_PARSEDQUERY_H
@@ -0,0 +1,183 @@
+#include "polyline.h"
+#include "geometry.h"
+
+#if defined(__AVX__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+using namespace GeoNLP;
+
+// number of segments processed in one block
+const size_t polyline_block = 64;
+
+Polyline::Polyline(const std::vector<double> &latitude, const std::vector<double> &longitude,
+                   size_t first)
+    : m_first(first)
+{
+  if (latitude.size() != longitude.size())
+    return;
+
+  const double dist_per_degree_lat = distance_per_latitude();
+  double       start               = 0;
+  for (size_t i = first; i + 1 < latitude.size(); ++i)
+    {
+      const double dist_per_degree_lon = distance_per_longitude(latitude[i]);
+      const double x1                  = latitude[i] * dist_per_degree_lat;
+      const double y1                  = longitude[i] * dist_per_degree_lon;
+      const double px                  = latitude[i + 1] * dist_per_degree_lat - x1;
+      const double py                  = longitude[i + 1] * dist_per_degree_lon - y1;
+      const double nrm2                = px * px + py * py;
+
+      m_x1.push_back(x1);
+      m_y1.push_back(y1);
+      m_px.push_back(px);
+      m_py.push_back(py);
+      m_inv2.push_back(nrm2 > 0 ? 1.0 / nrm2 : 0);
+      m_scale.push_back(dist_per_degree_lon);
+      m_length.push_back(sqrt(nrm2));
+      m_start.push_back(start);
+      start += m_length.back();
+    }
+}
+
+void Polyline::distances(size_t i0, size_t n, double xp, double longitude, double *d2,
+                         double *u) const
+{
+  const double *x1    = m_x1.data() + i0;
+  const double *y1    = m_y1.data() + i0;
+  const double *px    = m_px.data() + i0;
+  const double *py    = m_py.data() + i0;
+  const double *inv2  = m_inv2.data() + i0;
+  const double *scale = m_scale.data() + i0;
+
+  size_t i = 0;
+
+#if defined(__AVX__)
+  const __m256d vxp   = _mm256_set1_pd(xp);
+  const __m256d vlon  = _mm256_set1_pd(longitude);
+  const __m256d vzero = _mm256_setzero_pd();
+  const __m256d vone  = _mm256_set1_pd(1.0);
+  for (; i + 4 <= n; i += 4)
+    {
+      const __m256d vpx = _mm256_loadu_pd(px + i);
+      const __m256d vpy = _mm256_loadu_pd(py + i);
+      const __m256d dx0 = _mm256_sub_pd(vxp, _mm256_loadu_pd(x1 + i));
+      const __m256d yp  = _mm256_mul_pd(vlon, _mm256_loadu_pd(scale + i));
+      const __m256d dy0 = _mm256_sub_pd(yp, _mm256_loadu_pd(y1 + i));
+
+      __m256d vu = _mm256_mul_pd(_mm256_add_pd(_mm256_mul_pd(dx0, vpx), _mm256_mul_pd(dy0, vpy)),
+                                 _mm256_loadu_pd(inv2 + i));
+      vu         = _mm256_min_pd(vone, _mm256_max_pd(vzero, vu));
+
+      const __m256d dx = _mm256_sub_pd(_mm256_mul_pd(vu, vpx), dx0);
+      const __m256d dy = _mm256_sub_pd(_mm256_mul_pd(vu, vpy), dy0);
+      _mm256_storeu_pd(d2 + i, _mm256_add_pd(_mm256_mul_pd(dx, dx), _mm256_mul_pd(dy, dy)));
+      _mm256_storeu_pd(u + i, vu);
+    }
+#elif defined(__SSE2__)
+  const __m128d vxp   = _mm_set1_pd(xp);
+  const __m128d vlon  = _mm_set1_pd(longitude);
+  const __m128d vzero = _mm_setzero_pd();
+  const __m128d vone  = _mm_set1_pd(1.0);
+  for (; i + 2 <= n; i += 2)
+    {
+      const __m128d vpx = _mm_loadu_pd(px + i);
+      const __m128d vpy = _mm_loadu_pd(py + i);
+      const __m128d dx0 = _mm_sub_pd(vxp, _mm_loadu_pd(x1 + i));
+      const __m128d yp  = _mm_mul_pd(vlon, _mm_loadu_pd(scale + i));
+      const __m128d dy0 = _mm_sub_pd(yp, _mm_loadu_pd(y1 + i));
+
+      __m128d vu = _mm_mul_pd(_mm_add_pd(_mm_mul_pd(dx0, vpx), _mm_mul_pd(dy0, vpy)),
+                              _mm_loadu_pd(inv2 + i));
+      vu         = _mm_min_pd(vone, _mm_max_pd(vzero, vu));
+
+      const __m128d dx = _mm_sub_pd(_mm_mul_pd(vu, vpx), dx0);
+      const __m128d dy = _mm_sub_pd(_mm_mul_pd(vu, vpy), dy0);
+      _mm_storeu_pd(d2 + i, _mm_add_pd(_mm_mul_pd(dx, dx), _mm_mul_pd(dy, dy)));
+      _mm_storeu_pd(u + i, vu);
+    }
+#endif
+
+  // portable implementation and the remainder of SIMD loop
+  for (; i < n; ++i)
+    {
+      const double dx0 = xp - x1[i];
+      const double dy0 = longitude * scale[i] - y1[i];
+
+      double v = (dx0 * px[i] + dy0 * py[i]) * inv2[i];
+      v        = std::max(0.0, std::min(1.0, v));
+
+      const double dx = v * px[i] - dx0;
+      const double dy = v * py[i] - dy0;
+      d2[i]           = dx * dx + dy * dy;
+      u[i]            = v;
+    }
+}
+
+void Polyline::fill(size_t i, double d2, double u, Projection &projection) const
+{
+  projection.segment  = i + m_first;
+  projection.distance = sqrt(d2);
+  projection.offset   = m_start[i] + u * m_length[i];
+}
+
+bool Polyline::closest(double latitude, double longitude, Projection &projection, size_t seg0,
+                       size_t seg1) const
+{
+  // convert to internal numbering
+  const size_t i0 = std::max(seg0, m_first) - m_first;
+  const size_t i1 = std::min(seg1, last()) - m_first;
+  if (seg1 <= m_first || i0 >= i1)
+    return false;
+
+  const double xp = latitude * distance_per_latitude();
+
+  double d2[polyline_block], u[polyline_block];
+  double best_d2 = -1, best_u = 0;
+  size_t best = i0;
+  for (size_t b = i0; b < i1; b += polyline_block)
+    {
+      const size_t n = std::min(polyline_block, i1 - b);
+      distances(b, n, xp, longitude, d2, u);
+      for (size_t k = 0; k < n; ++k)
+        if (best_d2 < 0 || d2[k] < best_d2)
+          {
+            best    = b + k;
+            best_d2 = d2[k];
+            best_u  = u[k];
+          }
+    }
+
+  fill(best, best_d2, best_u, projection);
+  return true;
+}
+
+bool Polyline::first_within(double latitude, double longitude, double radius,
+                            Projection &projection, size_t seg0, size_t seg1) const
+{
+  // convert to internal numbering
+  const size_t i0 = std::max(seg0, m_first) - m_first;
+  const size_t i1 = std::min(seg1, last()) - m_first;
+  if (seg1 <= m_first || i0 >= i1)
+    return false;
+
+  const double xp      = latitude * distance_per_latitude();
+  const double radius2 = radius * radius;
+
+  double d2[polyline_block], u[polyline_block];
+  for (size_t b = i0; b < i1; b += polyline_block)
+    {
+      const size_t n = std::min(polyline_block, i1 - b);
+      distances(b, n, xp, longitude, d2, u);
+      for (size_t k = 0; k < n; ++k)
+        if (d2[k] <= radius2)
+          {
+            fill(b + k, d2[k], u[k], projection);
+            return true;
+          }
+    }
+
+  return false;
+}
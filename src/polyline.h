@@ -0,0 +1,80 @@
+#ifndef GEOCODER_POLYLINE_H
+#define GEOCODER_POLYLINE_H
+
+#include <cstddef>
+#include <limits>
+#include <vector>
+
+namespace GeoNLP
+{
+
+/// \brief Linestring projected into plane coordinates for distance calculations
+///
+/// The line is projected once on construction and the segments are
+/// kept as a structure of arrays. Each segment is projected using
+/// the longitude scale at its first point, as in the earth as a plane
+/// approximation around the segment. Distances between the points
+/// and the segments are calculated using SIMD instructions if they
+/// are enabled at compile time (AVX or SSE2) with the portable
+/// fallback otherwise.
+class Polyline
+{
+public:
+  struct Projection
+  {
+    size_t segment;  ///< segment index, numbered as in the original line
+    double distance; ///< distance from the point to the segment, meters
+    double offset;   ///< distance along the line to the projection of the point, meters
+  };
+
+  static const size_t npos = std::numeric_limits<size_t>::max();
+
+public:
+  Polyline() {}
+
+  /// \brief Project the line starting from the given point
+  ///
+  /// Segments are numbered as in the original line, offsets are
+  /// measured from the first projected point.
+  Polyline(const std::vector<double> &latitude, const std::vector<double> &longitude,
+           size_t first = 0);
+
+  size_t first() const { return m_first; }
+  size_t last() const { return m_first + m_x1.size(); } ///< index after the last segment
+  bool   empty() const { return m_x1.empty(); }
+
+  double length() const { return m_start.empty() ? 0 : m_start.back() + m_length.back(); }
+  double offset(size_t segment) const { return m_start[segment - m_first]; }
+
+  /// \brief Find the closest segment among segments [seg0, seg1)
+  bool closest(double latitude, double longitude, Projection &projection, size_t seg0 = 0,
+               size_t seg1 = npos) const;
+
+  /// \brief Find the first segment among [seg0, seg1) within radius from the point
+  bool first_within(double latitude, double longitude, double radius, Projection &projection,
+                    size_t seg0 = 0, size_t seg1 = npos) const;
+
+protected:
+  // squared distances and projection coefficients for segments
+  // [i0, i0+n) in internal numbering
+  void distances(size_t i0, size_t n, double xp, double longitude, double *d2, double *u) const;
+
+  void fill(size_t i, double d2, double u, Projection &projection) const;
+
+protected:
+  size_t m_first = 0;
+
+  std::vector<double> m_x1;    ///< latitude of the first point, meters
+  std::vector<double> m_y1;    ///< longitude of the first point, meters
+  std::vector<double> m_px;    ///< segment vector along latitude, meters
+  std::vector<double> m_py;    ///< segment vector along longitude, meters
+  std::vector<double> m_inv2;  ///< inverse of the squared segment length, 0 for empty segments
+  std::vector<double> m_scale; ///< meters per degree of longitude used by segment
+
+  std::vector<double> m_length; ///< segment length, meters
+  std::vector<double> m_start;  ///< distance along the line to the segment start, meters
+};
+
+}
+
+#endif // GEOCODER_POLYLINE_H
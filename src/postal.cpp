@@ -14,22 +14,7 @@
 
 using namespace GeoNLP;
 
-#define ADDRESS_PARSER_LABEL_HOUSE "house"
-#define ADDRESS_PARSER_LABEL_CATEGORY "category"
-#define ADDRESS_PARSER_LABEL_HOUSE_NUMBER "house_number"
-#define ADDRESS_PARSER_LABEL_ROAD "road"
-#define ADDRESS_PARSER_LABEL_SUBURB "suburb"
-#define ADDRESS_PARSER_LABEL_CITY_DISTRICT "city_district"
-#define ADDRESS_PARSER_LABEL_CITY "city"
-#define ADDRESS_PARSER_LABEL_ISLAND "island"
-#define ADDRESS_PARSER_LABEL_STATE_DISTRICT "state_district"
-#define ADDRESS_PARSER_LABEL_STATE "state"
-#define ADDRESS_PARSER_LABEL_POSTAL_CODE "postcode"
-#define ADDRESS_PARSER_LABEL_COUNTRY_REGION "country_region"
-#define ADDRESS_PARSER_LABEL_COUNTRY "country"
-
 #define PRIMITIVE_ADDRESS_PARSER_POSTAL_CODE_INPUT "post:"
-#define PRIMITIVE_ADDRESS_PARSER_POSTAL_CODE_KEY "h-postcode"
 
 //////////////////////////////////////////////////////////////////////
 /// Helper string functions
@@ -76,13 +61,6 @@ static void split_tokens(const std::string &s, char delim, std::vector<std::stri
       elems.push_back(trim(item));
 }
 
-static std::string primitive_key(size_t ind)
-{
-  std::ostringstream ss;
-  ss << "h-" << ind;
-  return ss.str();
-}
-
 ///////////////////////////////////////////////////////////////////
 /// Postal class
 
@@ -90,11 +68,73 @@ Postal::Postal() {}
 
 Postal::~Postal()
 {
+  {
+    std::lock_guard<std::recursive_mutex> lk(m_mutex);
+    m_engine_stop = true;
+  }
+  m_engine_cv.notify_all();
+  if (m_engine.joinable())
+    m_engine.join();
+
   drop();
 }
 
+void Postal::start()
+{
+  std::lock_guard<std::recursive_mutex> lk(m_mutex);
+  m_start_requested = true;
+  start_engine();
+  m_engine_cv.notify_all();
+}
+
+void Postal::set_idle_timeout(double seconds)
+{
+  std::lock_guard<std::recursive_mutex> lk(m_mutex);
+  m_idle_timeout = seconds;
+  if (m_idle_timeout > 0)
+    start_engine();
+  m_engine_cv.notify_all();
+}
+
+void Postal::start_engine()
+{
+  if (!m_engine.joinable())
+    m_engine = std::thread(&Postal::engine, this);
+}
+
+void Postal::engine()
+{
+  std::unique_lock<std::recursive_mutex> lk(m_mutex);
+  while (!m_engine_stop)
+    {
+      if (m_start_requested)
+        {
+          m_start_requested = false;
+          if (!init())
+            std::cerr << "Postal: Error initializing libpostal in background\n";
+          continue;
+        }
+
+      if (m_initialized && m_idle_timeout > 0)
+        {
+          auto deadline
+              = m_last_use
+                + std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+                    std::chrono::duration<double>(m_idle_timeout));
+          if (std::chrono::steady_clock::now() >= deadline)
+            drop();
+          else
+            m_engine_cv.wait_until(lk, deadline);
+        }
+      else
+        m_engine_cv.wait(lk);
+    }
+}
+
 void Postal::set_postal_datadir(const std::string &global, const std::string &country)
 {
+  std::lock_guard<std::recursive_mutex> lk(m_mutex);
+
   if (global.length() < 1)
     m_postal_datadir_global.clear();
   else
@@ -105,11 +145,14 @@ void Postal::set_postal_datadir(const std::string &global, const std::string &co
   else
     str2vecchar(country, m_postal_datadir_country);
 
-  drop(); // force reinitialization
+  m_expansion_cache.clear(); // expansions depend on libpostal data
+  drop();                    // force reinitialization
 }
 
 void Postal::set_postal_datadir_country(const std::string &country)
 {
+  std::lock_guard<std::recursive_mutex> lk(m_mutex);
+
   std::vector<char> nc;
   if (country.length() >= 1)
     str2vecchar(country, nc);
@@ -133,8 +176,27 @@ void Postal::set_postal_datadir_country(const std::string &country)
     }
 }
 
+void Postal::set_use_postal(bool v)
+{
+  std::lock_guard<std::recursive_mutex> lk(m_mutex);
+
+  m_use_postal = v;
+  if (!v)
+    drop();
+}
+
+void Postal::clear_languages()
+{
+  std::lock_guard<std::recursive_mutex> lk(m_mutex);
+
+  m_postal_languages.clear();
+  drop();
+}
+
 void Postal::add_language(const std::string &lang)
 {
+  std::lock_guard<std::recursive_mutex> lk(m_mutex);
+
   std::vector<char> l;
   str2vecchar(lang, l);
   m_postal_languages.push_back(l);
@@ -143,6 +205,8 @@ void Postal::add_language(const std::string &lang)
 
 bool Postal::init()
 {
+  std::lock_guard<std::recursive_mutex> lk(m_mutex);
+
   if (m_initialized)
     return true;
 
@@ -169,11 +233,17 @@ bool Postal::init()
     }
 
   m_initialized = true;
+  touch();
+
+  // let the engine start counting idle time
+  m_engine_cv.notify_all();
   return true;
 }
 
 void Postal::drop()
 {
+  std::lock_guard<std::recursive_mutex> lk(m_mutex);
+
   if (!m_initialized)
     return;
   libpostal_teardown_parser();
@@ -227,6 +297,49 @@ void Postal::drop()
 
 bool Postal::parse(const std::string &input, std::vector<Postal::ParseResult> &result,
                    Postal::ParseResult &nonormalization)
+{
+  ParsedQuery parsed;
+  if (!parse(input, parsed, nonormalization))
+    return false;
+  parsed.to_parse_results(result);
+  return true;
+}
+
+bool Postal::parse(const std::string &input, ParsedQuery &result,
+                   Postal::ParseResult &nonormalization)
+{
+  std::lock_guard<std::recursive_mutex> lk(m_mutex);
+
+  bool ok = parse_locked(input, result, nonormalization);
+
+  if (m_initialize_for_every_call)
+    drop();
+
+  return ok;
+}
+
+bool Postal::parse_batch(const std::vector<std::string> &input, std::vector<ParsedQuery> &parsed,
+                         std::vector<ParseResult> &nonormalization)
+{
+  std::lock_guard<std::recursive_mutex> lk(m_mutex);
+
+  parsed.clear();
+  nonormalization.clear();
+  parsed.resize(input.size());
+  nonormalization.resize(input.size());
+
+  bool ok = true;
+  for (size_t i = 0; ok && i < input.size(); ++i)
+    ok = parse_locked(input[i], parsed[i], nonormalization[i]);
+
+  if (m_initialize_for_every_call)
+    drop();
+
+  return ok;
+}
+
+bool Postal::parse_locked(const std::string &input, ParsedQuery &result,
+                          Postal::ParseResult &nonormalization)
 {
   if (m_use_postal && !init())
     return false;
@@ -246,15 +359,19 @@ bool Postal::parse(const std::string &input, std::vector<Postal::ParseResult> &r
       libpostal_address_parser_response_t *parsed
           = libpostal_parse_address(charbuff.data(), options_parse);
       nonormalization.clear();
+      result.add_result();
       for (size_t j = 0; j < parsed->num_components; j++)
         {
           std::vector<std::string> pc;
           pc.push_back(parsed->components[j]);
           nonormalization[parsed->labels[j]] = pc;
+
+          // labels unknown to the geocoder are not used in search
+          ParsedQuery::Label label;
+          if (ParsedQuery::label_from_name(parsed->labels[j], label))
+            result.add(label, expand(parsed->components[j], label != ParsedQuery::PostalCode));
         }
       libpostal_address_parser_response_destroy(parsed);
-
-      expand(nonormalization, result);
     }
 
   // primitive parsing
@@ -265,99 +382,70 @@ bool Postal::parse(const std::string &input, std::vector<Postal::ParseResult> &r
       if (hier.empty())
         hier.push_back(input);
 
-      ParseResult prim;
-      int         shift = 0;
-      size_t      np    = strlen(PRIMITIVE_ADDRESS_PARSER_POSTAL_CODE_INPUT);
+      result.add_result();
+      size_t np = strlen(PRIMITIVE_ADDRESS_PARSER_POSTAL_CODE_INPUT);
       for (size_t j = 0; j < hier.size(); j++)
         {
-          std::string v   = hier[hier.size() - j - 1];
-          std::string key = primitive_key(j - shift);
-          v               = trim(v);
+          std::string v = hier[hier.size() - j - 1];
+          v             = trim(v);
           if (v.compare(0, np, PRIMITIVE_ADDRESS_PARSER_POSTAL_CODE_INPUT) == 0)
             {
-              v   = v.substr(np);
-              v   = trim(v);
-              key = PRIMITIVE_ADDRESS_PARSER_POSTAL_CODE_KEY;
-              shift += 1;
+              v = v.substr(np);
+              v = trim(v);
+              result.add(ParsedQuery::PrimitivePostalCode, expand(v, false));
             }
-          std::vector<std::string> pc;
-          pc.push_back(v);
-          prim[key] = pc;
+          else
+            result.add_primitive(expand(v, true));
         }
-
-      expand(prim, result);
     }
 
-  if (m_initialize_for_every_call)
-    drop();
-
+  touch();
   return true;
 }
 
-void Postal::expand(const Postal::ParseResult &input, std::vector<Postal::ParseResult> &result)
+std::vector<std::string> Postal::expand(const std::string &component, bool use_expansions)
 {
-  if (!init())
+  // always add unexpanded result into address expansions
+  // this will help with the partial entries as described in
+  // issue #64 https://github.com/rinigus/geocoder-nlp/issues/64
+  std::set<std::string> norm;
+  norm.insert(component);
+
+  // no need to keep postal code in normalized and expanded
+  if (use_expansions && init())
     {
-      result.push_back(input);
-      return;
+      std::vector<std::string> expansions;
+      expand_address(component, expansions);
+      norm.insert(expansions.begin(), expansions.end());
     }
 
-  size_t                        num_expansions;
-  libpostal_normalize_options_t options_norm = libpostal_get_default_options();
-
-  std::vector<char *> lang;
-  for (std::vector<char> &l : m_postal_languages)
-    lang.push_back(l.data());
-
-  options_norm.languages     = lang.data();
-  options_norm.num_languages = lang.size();
-
-  std::vector<char> charbuff;
-
-  std::vector<std::vector<std::string> > address_expansions;
-  std::vector<std::string>               address_keys;
-  for (const auto &i : input)
-    {
-      // in practice, its only one element at ParseResult at this stage
-      for (const std::string &tonorm : i.second)
-        {
-          std::set<std::string> norm;
-          // always add unexpanded result into address expansions
-          // this will help with the partial entries as described in
-          // issue #64 https://github.com/rinigus/geocoder-nlp/issues/64
-          norm.insert(tonorm);
-          // no need to keep postal code in normalized and expanded
-          if (i.first != ADDRESS_PARSER_LABEL_POSTAL_CODE
-              && i.first != PRIMITIVE_ADDRESS_PARSER_POSTAL_CODE_KEY)
-            {
-              charbuff.resize(tonorm.length() + 1);
-              std::copy(tonorm.c_str(), tonorm.c_str() + tonorm.length() + 1, charbuff.begin());
-              char **expansions
-                  = libpostal_expand_address(charbuff.data(), options_norm, &num_expansions);
-              for (size_t j = 0; j < num_expansions; j++)
-                norm.insert(expansions[j]);
-
-              libpostal_expansion_array_destroy(expansions, num_expansions);
-            }
-          address_expansions.push_back(std::vector<std::string>(norm.begin(), norm.end()));
-          address_keys.push_back(i.first);
-        }
-    }
-
-  ParseResult r;
-  for (size_t i = 0; i < address_keys.size(); ++i)
-    r[address_keys[i]] = address_expansions[i];
-  result.push_back(r);
+  return std::vector<std::string>(norm.begin(), norm.end());
 }
 
 void Postal::expand_string(const std::string &input, std::vector<std::string> &expansions)
 {
+  std::lock_guard<std::recursive_mutex> lk(m_mutex);
+
   if (!m_use_postal || !init())
     {
       expansions.push_back(input);
       return;
     }
 
+  expand_address(input, expansions);
+  touch();
+}
+
+void Postal::expand_address(const std::string &input, std::vector<std::string> &expansions)
+{
+  std::vector<std::string> languages;
+  for (const std::vector<char> &l : m_postal_languages)
+    languages.push_back(l.data());
+
+  const std::string key = ExpansionCache::make_key(input, languages);
+  if (m_expansion_cache.get(key, expansions))
+    return;
+
   size_t                        num_expansions;
   libpostal_normalize_options_t options_norm = libpostal_get_default_options();
 
@@ -373,11 +461,27 @@ void Postal::expand_string(const std::string &input, std::vector<std::string> &e
   charbuff.resize(input.length() + 1);
   std::copy(input.c_str(), input.c_str() + input.length() + 1, charbuff.begin());
 
+  std::vector<std::string> result;
   char **expansions_cstr = libpostal_expand_address(charbuff.data(), options_norm, &num_expansions);
   for (size_t j = 0; j < num_expansions; j++)
-    expansions.push_back(expansions_cstr[j]);
+    result.push_back(expansions_cstr[j]);
 
   libpostal_expansion_array_destroy(expansions_cstr, num_expansions);
+
+  m_expansion_cache.put(key, result);
+  expansions.insert(expansions.end(), result.begin(), result.end());
+}
+
+void Postal::set_expansion_cache_capacity(size_t capacity)
+{
+  std::lock_guard<std::recursive_mutex> lk(m_mutex);
+  m_expansion_cache.set_capacity(capacity);
+}
+
+void Postal::clear_expansion_cache()
+{
+  std::lock_guard<std::recursive_mutex> lk(m_mutex);
+  m_expansion_cache.clear();
 }
 
 std::string Postal::normalize_postalcode(const std::string &postal_code)
@@ -409,57 +513,25 @@ std::string Postal::normalize_postalcode(const std::string &postal_code)
 void Postal::result2hierarchy(const std::vector<ParseResult> &p, std::vector<Hierarchy> &h,
                               std::string &postal_code)
 {
+  ParsedQuery query;
+  query.from_parse_results(p);
+
+  std::vector<ParsedQuery::Hierarchy> qh;
+  query.hierarchies(qh, postal_code);
+
+  // copy out of the string pool of the query
   h.clear();
-  for (const ParseResult &r : p)
+  for (const ParsedQuery::Hierarchy &q : qh)
     {
       Hierarchy h_result;
-
-#define ADDIFHAS(k)                                                                                \
-  {                                                                                                \
-    ParseResult::const_iterator it = r.find(k);                                                    \
-    if (it != r.end())                                                                             \
-      h_result.push_back(it->second);                                                              \
-  }
-
-      ADDIFHAS(ADDRESS_PARSER_LABEL_COUNTRY);
-      ADDIFHAS(ADDRESS_PARSER_LABEL_COUNTRY_REGION);
-      ADDIFHAS(ADDRESS_PARSER_LABEL_STATE);
-      ADDIFHAS(ADDRESS_PARSER_LABEL_STATE_DISTRICT);
-      ADDIFHAS(ADDRESS_PARSER_LABEL_ISLAND);
-      ADDIFHAS(ADDRESS_PARSER_LABEL_CITY);
-      ADDIFHAS(ADDRESS_PARSER_LABEL_CITY_DISTRICT);
-      ADDIFHAS(ADDRESS_PARSER_LABEL_SUBURB);
-      ADDIFHAS(ADDRESS_PARSER_LABEL_ROAD);
-      ADDIFHAS(ADDRESS_PARSER_LABEL_HOUSE_NUMBER);
-      ADDIFHAS(ADDRESS_PARSER_LABEL_CATEGORY);
-      ADDIFHAS(ADDRESS_PARSER_LABEL_HOUSE);
-
-      if (postal_code.empty())
-        {
-          ParseResult::const_iterator it = r.find(ADDRESS_PARSER_LABEL_POSTAL_CODE);
-          if (it != r.end() && it->second.size())
-            postal_code = normalize_postalcode(it->second[0]);
-        }
-
-      // test if its primitive expansion result
-      if (h_result.empty())
-        {
-          bool done = false;
-          for (size_t i = 0; !done; ++i)
-            {
-              ParseResult::const_iterator it = r.find(primitive_key(i));
-              if (it == r.end())
-                done = true;
-              else
-                h_result.push_back(it->second);
-            }
-        }
-
-      // overwrite with the primitive parser postal code if needed
-      ParseResult::const_iterator it = r.find(PRIMITIVE_ADDRESS_PARSER_POSTAL_CODE_KEY);
-      if (it != r.end() && it->second.size())
-        postal_code = normalize_postalcode(it->second[0]);
-
+      for (const ParsedQuery::Expansions &e : q)
+        h_result.push_back(std::vector<std::string>(e.begin(), e.end()));
       h.push_back(h_result);
     }
 }
+
+void Postal::result2hierarchy(const ParsedQuery &p, std::vector<ParsedQuery::Hierarchy> &h,
+                              std::string &postal_code)
+{
+  p.hierarchies(h, postal_code);
+}
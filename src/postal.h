@@ -1,8 +1,15 @@
 #ifndef POSTAL_H
 #define POSTAL_H
 
+#include "expansioncache.h"
+#include "parsedquery.h"
+
+#include <chrono>
+#include <condition_variable>
 #include <map>
+#include <mutex>
 #include <string>
+#include <thread>
 #include <vector>
 
 namespace GeoNLP
@@ -14,51 +21,99 @@ public:
   Postal();
   ~Postal();
 
-  typedef std::map<std::string, std::vector<std::string> > ParseResult;
-  typedef std::vector<std::vector<std::string> >           Hierarchy;
+  typedef ParsedQuery::ParseResult                ParseResult;
+  typedef std::vector<std::vector<std::string> > Hierarchy;
 
   static std::string normalize_postalcode(const std::string &postal_code);
   static void        result2hierarchy(const std::vector<ParseResult> &p, std::vector<Hierarchy> &h,
                                       std::string &postal_code);
 
+  /// \brief Hierarchies referring to the string pool of the parsed query
+  static void result2hierarchy(const ParsedQuery &p, std::vector<ParsedQuery::Hierarchy> &h,
+                               std::string &postal_code);
+
   /// \brief Parse and normalize input string
   ///
+  /// Results are appended to the parsed query.
+  bool parse(const std::string &input, ParsedQuery &parsed, ParseResult &nonormalization);
+
+  /// \brief Parse and normalize input string into map-based results
   bool parse(const std::string &input, std::vector<Postal::ParseResult> &parsed,
              ParseResult &nonormalization);
 
+  /// \brief Parse and normalize several input strings
+  ///
+  /// libpostal is initialized and, if requested, released once for
+  /// the whole batch. Parsed queries and the results without
+  /// normalization are given in the order of the input.
+  bool parse_batch(const std::vector<std::string> &input, std::vector<ParsedQuery> &parsed,
+                   std::vector<ParseResult> &nonormalization);
+
   /// \brief Normalize input string and return its expansions
   ///
   void expand_string(const std::string &input, std::vector<std::string> &expansions);
 
+  /// \brief Initialize libpostal in background
+  ///
+  /// Call at the application start to have libpostal ready by the
+  /// first query. Calls that need libpostal wait for the
+  /// initialization to finish, if it has not been finished yet.
+  void start();
+
+  /// \brief Time in seconds after the last use when libpostal is released
+  ///
+  /// libpostal is released in background to free memory and is
+  /// initialized again on the next call. Zero disables releasing.
+  double get_idle_timeout() const { return m_idle_timeout; }
+  void   set_idle_timeout(double seconds);
+
+  /// \brief Memory in bytes used to cache expansions, zero disables caching
+  size_t get_expansion_cache_capacity() const { return m_expansion_cache.get_capacity(); }
+  void   set_expansion_cache_capacity(size_t capacity);
+
+  /// \brief Expansion cache statistics
+  size_t get_expansion_cache_hits() const { return m_expansion_cache.hits(); }
+  size_t get_expansion_cache_misses() const { return m_expansion_cache.misses(); }
+  size_t get_expansion_cache_memory() const { return m_expansion_cache.memory(); }
+
+  void clear_expansion_cache();
+
   bool get_initialize_every_call() const { return m_initialize_for_every_call; }
   void set_initialize_every_call(bool v) { m_initialize_for_every_call = v; }
 
   bool get_use_postal() const { return m_use_postal; }
-  void set_use_postal(bool v)
-  {
-    m_use_postal = v;
-    if (!v)
-      drop();
-  }
+  void set_use_postal(bool v);
 
   bool get_use_primitive() const { return m_use_primitive; }
   void set_use_primitive(bool v) { m_use_primitive = v; }
 
   void set_postal_datadir(const std::string &global, const std::string &country);
+
+  /// \brief Change country parser, libpostal parser is reloaded
+  ///
+  /// Use PostalPool to keep parsers of several countries loaded.
   void set_postal_datadir_country(const std::string &country);
 
-  void clear_languages()
-  {
-    m_postal_languages.clear();
-    drop();
-  }
+  void clear_languages();
   void add_language(const std::string &lang);
 
 protected:
   bool init();
   void drop();
 
-  void expand(const Postal::ParseResult &input, std::vector<Postal::ParseResult> &result);
+  // background thread initializing and releasing libpostal
+  void engine();
+  void start_engine();
+  void touch() { m_last_use = std::chrono::steady_clock::now(); }
+
+  // parse without releasing libpostal. has to be called with the mutex locked
+  bool parse_locked(const std::string &input, ParsedQuery &result, ParseResult &nonormalization);
+
+  // expansions of the parsed component, including the component itself
+  std::vector<std::string> expand(const std::string &component, bool use_expansions);
+
+  // expand using libpostal with the cache. libpostal has to be initialized
+  void expand_address(const std::string &input, std::vector<std::string> &expansions);
 
 protected:
   bool m_initialized               = false;
@@ -66,9 +121,22 @@ protected:
   bool m_use_postal                = true;
   bool m_use_primitive             = true;
 
+  // guards libpostal and the state of the class. recursive as the
+  // public methods call each other
+  std::recursive_mutex        m_mutex;
+  std::condition_variable_any m_engine_cv;
+  std::thread                 m_engine;
+  bool                        m_engine_stop     = false;
+  bool                        m_start_requested = false;
+  double                      m_idle_timeout    = 0;
+
+  std::chrono::steady_clock::time_point m_last_use;
+
   std::vector<char>               m_postal_datadir_global;
   std::vector<char>               m_postal_datadir_country;
   std::vector<std::vector<char> > m_postal_languages;
+
+  ExpansionCache m_expansion_cache;
 };
 
 }
@@ -0,0 +1,152 @@
+#include "postalpool.h"
+
+#include <algorithm>
+#include <iostream>
+
+using namespace GeoNLP;
+
+PostalPool::PostalPool()
+{
+  // parsers are forked later from query threads, zygote is needed
+  // before them
+  PostalService::initialize();
+}
+
+void PostalPool::set_postal_datadir(const std::string &global, const std::string &countries)
+{
+  std::lock_guard<std::mutex> lk(m_mutex);
+  m_datadir_global    = global;
+  m_datadir_countries = countries;
+}
+
+void PostalPool::add_language(const std::string &lang)
+{
+  std::lock_guard<std::mutex> lk(m_mutex);
+  m_languages.push_back(lang);
+}
+
+void PostalPool::set_use_postal(bool v)
+{
+  std::lock_guard<std::mutex> lk(m_mutex);
+  m_use_postal = v;
+}
+
+void PostalPool::set_use_primitive(bool v)
+{
+  std::lock_guard<std::mutex> lk(m_mutex);
+  m_use_primitive = v;
+}
+
+void PostalPool::set_max_countries(size_t mx)
+{
+  std::vector<std::shared_ptr<PostalService> > evicted;
+  std::lock_guard<std::mutex>                  lk(m_mutex);
+  m_max_countries = std::max(mx, (size_t)1);
+  trim(evicted);
+}
+
+std::vector<std::string> PostalPool::loaded_countries()
+{
+  std::lock_guard<std::mutex> lk(m_mutex);
+  return std::vector<std::string>(m_lru.begin(), m_lru.end());
+}
+
+void PostalPool::clear()
+{
+  std::map<std::string, std::shared_ptr<PostalService> > evicted;
+  std::lock_guard<std::mutex>                            lk(m_mutex);
+  m_lru.clear();
+  m_services.swap(evicted);
+}
+
+std::shared_ptr<PostalService> PostalPool::service(const std::string &country)
+{
+  return services(std::vector<std::string>(1, country)).front();
+}
+
+std::vector<std::shared_ptr<PostalService> >
+PostalPool::services(const std::vector<std::string> &countries)
+{
+  std::vector<std::shared_ptr<PostalService> > evicted;
+  std::vector<std::shared_ptr<PostalService> > result;
+  std::lock_guard<std::mutex>                  lk(m_mutex);
+
+  // all requested services are acquired before trimming, so none of
+  // them is evicted by the others
+  for (const std::string &country : countries)
+    {
+      auto s = m_services.find(country);
+      if (s != m_services.end())
+        {
+          m_lru.remove(country);
+          m_lru.push_front(country);
+          result.push_back(s->second);
+          continue;
+        }
+
+      std::shared_ptr<PostalService> service
+          = std::make_shared<PostalService>(PostalService::WorkerForked, 1);
+
+      std::string datadir_country;
+      if (!country.empty() && !m_datadir_countries.empty())
+        datadir_country = m_datadir_countries + "/" + country;
+
+      service->set_postal_datadir(m_datadir_global, datadir_country);
+      for (const std::string &l : m_languages)
+        service->add_language(l);
+      service->set_use_postal(m_use_postal);
+      service->set_use_primitive(m_use_primitive);
+
+      m_services[country] = service;
+      m_lru.push_front(country);
+      result.push_back(service);
+    }
+
+  std::set<std::string> pinned(countries.begin(), countries.end());
+  if (pinned.size() > m_max_countries)
+    std::cerr << "PostalPool: " << pinned.size() << " countries requested, but only "
+              << m_max_countries << " are kept loaded. Increase the limit to avoid reloading\n";
+
+  trim(evicted, pinned);
+  return result;
+}
+
+void PostalPool::trim(std::vector<std::shared_ptr<PostalService> > &evicted,
+                      const std::set<std::string>                  &pinned)
+{
+  // pinned countries are the most recently used ones, at the front
+  while (m_lru.size() > m_max_countries && !pinned.count(m_lru.back()))
+    {
+      evicted.push_back(m_services[m_lru.back()]);
+      m_services.erase(m_lru.back());
+      m_lru.pop_back();
+    }
+}
+
+std::future<PostalService::ParseReply> PostalPool::parse(const std::string &country,
+                                                         const std::string &input)
+{
+  return service(country)->parse(input);
+}
+
+std::map<std::string, std::future<PostalService::ParseReply> >
+PostalPool::parse(const std::set<std::string> &countries, const std::string &input)
+{
+  std::vector<std::string>                     c(countries.begin(), countries.end());
+  std::vector<std::shared_ptr<PostalService> > s = services(c);
+
+  std::map<std::string, std::future<PostalService::ParseReply> > result;
+  for (size_t i = 0; i < c.size(); ++i)
+    result[c[i]] = s[i]->parse(input);
+  return result;
+}
+
+bool PostalPool::parse(const std::string &country, const std::string &input,
+                       std::vector<Postal::ParseResult> &parsed,
+                       Postal::ParseResult              &nonormalization)
+{
+  PostalService::ParseReply reply = parse(country, input).get();
+  parsed                          = reply.parsed;
+  nonormalization                 = reply.nonormalization;
+  return reply.ok;
+}
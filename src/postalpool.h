@@ -0,0 +1,101 @@
+#ifndef GEOCODER_POSTALPOOL_H
+#define GEOCODER_POSTALPOOL_H
+
+#include "postal.h"
+#include "postalservice.h"
+
+#include <future>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <vector>
+
+namespace GeoNLP
+{
+
+/// \brief Resident libpostal parsers for several countries
+///
+/// Postal keeps one country-specific parser and has to reload
+/// libpostal when the country is changed. PostalPool keeps a
+/// separate forked parser process for each country that has been
+/// used recently, so the queries to databases of different
+/// countries can be parsed without reloading. The least recently
+/// used parsers are stopped when the number of loaded countries
+/// exceeds the limit.
+///
+/// Country parser data is expected in the subdirectory named by the
+/// country in the countries directory. Empty country selects the
+/// parser from the global libpostal data. Country of a database is
+/// given by Geocoder::get_postal_country_parser.
+///
+/// PostalPool can be used from several threads, but it has to be
+/// created before other threads are started, see PostalService.
+class PostalPool
+{
+public:
+  PostalPool();
+
+  PostalPool(const PostalPool &) = delete;
+  PostalPool &operator=(const PostalPool &) = delete;
+
+  /// \brief Configuration of the parsers, applied to the parsers loaded after the call
+  void set_postal_datadir(const std::string &global, const std::string &countries);
+  void add_language(const std::string &lang);
+  void set_use_postal(bool v);
+  void set_use_primitive(bool v);
+
+  /// \brief Maximal number of country parsers kept loaded
+  size_t get_max_countries() const { return m_max_countries; }
+  void   set_max_countries(size_t mx);
+
+  /// \brief Countries with loaded parsers, most recently used first
+  std::vector<std::string> loaded_countries();
+
+  /// \brief Stop all parsers
+  void clear();
+
+  std::future<PostalService::ParseReply> parse(const std::string &country,
+                                               const std::string &input);
+
+  /// \brief Parse input string using the parsers of all given countries
+  ///
+  /// Parsers of these countries are kept loaded during the call even
+  /// if their number exceeds the limit.
+  std::map<std::string, std::future<PostalService::ParseReply> >
+  parse(const std::set<std::string> &countries, const std::string &input);
+
+  /// \brief Parse and normalize input string using the parser of the country
+  bool parse(const std::string &country, const std::string &input,
+             std::vector<Postal::ParseResult> &parsed, Postal::ParseResult &nonormalization);
+
+protected:
+  std::shared_ptr<PostalService>                service(const std::string &country);
+  std::vector<std::shared_ptr<PostalService> > services(const std::vector<std::string> &countries);
+
+  // evicted services are returned to be stopped outside the lock.
+  // pinned countries are not evicted
+  void trim(std::vector<std::shared_ptr<PostalService> > &evicted,
+            const std::set<std::string>                  &pinned = std::set<std::string>());
+
+protected:
+  std::mutex m_mutex;
+
+  std::string              m_datadir_global;
+  std::string              m_datadir_countries;
+  std::vector<std::string> m_languages;
+  bool                     m_use_postal    = true;
+  bool                     m_use_primitive = true;
+  size_t                   m_max_countries = 2;
+
+  // services are shared with the callers, so a service evicted while
+  // in use is stopped after its requests are finished
+  std::list<std::string>                                 m_lru;
+  std::map<std::string, std::shared_ptr<PostalService> > m_services;
+};
+
+}
+
+#endif // GEOCODER_POSTALPOOL_H
@@ -0,0 +1,350 @@
+#include "postalservice.h"
+
+#include <cstdint>
+#include <iostream>
+
+using namespace GeoNLP;
+
+//////////////////////////////////////////////////////////////////////
+/// Serialization of parse results for forked workers
+///
+
+static void write_parse_result(std::string &buffer, const Postal::ParseResult &r)
+{
+  ForkedWorker::write_size(buffer, r.size());
+  for (const auto &i : r)
+    {
+      ForkedWorker::write_string(buffer, i.first);
+      ForkedWorker::write_strings(buffer, i.second);
+    }
+}
+
+static bool read_parse_result(const std::string &buffer, size_t &pos, Postal::ParseResult &r)
+{
+  uint64_t n;
+  if (!ForkedWorker::read_size(buffer, pos, n))
+    return false;
+  r.clear();
+  for (uint64_t i = 0; i < n; ++i)
+    {
+      std::string key;
+      if (!ForkedWorker::read_string(buffer, pos, key)
+          || !ForkedWorker::read_strings(buffer, pos, r[key]))
+        return false;
+    }
+  return true;
+}
+
+const char request_parse  = 'p';
+const char request_expand = 'e';
+
+// workers are forked by the zygote with handlers made by this factory
+const char *const worker_factory = "postal";
+
+static const bool worker_factory_registered
+    = ForkedWorker::register_factory(worker_factory, &PostalService::make_handler);
+
+//////////////////////////////////////////////////////////////////////
+/// Parsers used by the workers
+///
+
+namespace
+{
+// parser in the same process
+class LocalParser : public PostalService::Parser
+{
+public:
+  Postal postal;
+
+  bool parse(const std::string &input, std::vector<Postal::ParseResult> &parsed,
+             Postal::ParseResult &nonormalization) override
+  {
+    return postal.parse(input, parsed, nonormalization);
+  }
+
+  void expand_string(const std::string &input, std::vector<std::string> &expansions) override
+  {
+    postal.expand_string(input, expansions);
+  }
+};
+
+// parser in forked process
+class ForkedParser : public PostalService::Parser
+{
+public:
+  ForkedParser(const std::string &config) : m_config(config) {}
+
+  bool start() { return m_worker.start(worker_factory, m_config); }
+
+  bool parse(const std::string &input, std::vector<Postal::ParseResult> &parsed,
+             Postal::ParseResult &nonormalization) override
+  {
+    std::string response;
+    if (!call(request_parse + input, response))
+      return false;
+
+    size_t      pos = 0;
+    std::string ok;
+    uint64_t    n;
+    if (!ForkedWorker::read_string(response, pos, ok) || ok != "1"
+        || !read_parse_result(response, pos, nonormalization)
+        || !ForkedWorker::read_size(response, pos, n))
+      return false;
+
+    parsed.resize(n);
+    for (Postal::ParseResult &r : parsed)
+      if (!read_parse_result(response, pos, r))
+        return false;
+
+    return true;
+  }
+
+  void expand_string(const std::string &input, std::vector<std::string> &expansions) override
+  {
+    std::string              response;
+    std::vector<std::string> e;
+    size_t                   pos = 0;
+    if (call(request_expand + input, response) && ForkedWorker::read_strings(response, pos, e))
+      expansions.insert(expansions.end(), e.begin(), e.end());
+  }
+
+protected:
+  // restart the worker once if it has stopped
+  bool call(const std::string &request, std::string &response)
+  {
+    if (!m_worker.running() && !start())
+      return false;
+    return m_worker.call(request, response);
+  }
+
+protected:
+  std::string  m_config;
+  ForkedWorker m_worker;
+};
+}
+
+//////////////////////////////////////////////////////////////////////
+/// PostalService
+///
+
+PostalService::PostalService(WorkerType type, size_t workers)
+    : m_type(type), m_workers(type == WorkerInProcess ? 1 : std::max(workers, (size_t)1))
+{
+  // zygote is forked as early as possible, while the program is
+  // expected to have a single thread
+  if (m_type == WorkerForked)
+    ForkedWorker::start_zygote();
+}
+
+bool PostalService::initialize()
+{
+  return ForkedWorker::start_zygote();
+}
+
+PostalService::~PostalService()
+{
+  stop();
+}
+
+void PostalService::set_postal_datadir(const std::string &global, const std::string &country)
+{
+  m_datadir_global  = global;
+  m_datadir_country = country;
+}
+
+void PostalService::add_language(const std::string &lang)
+{
+  m_languages.push_back(lang);
+}
+
+void PostalService::configure(Postal &postal) const
+{
+  postal.set_postal_datadir(m_datadir_global, m_datadir_country);
+  for (const std::string &l : m_languages)
+    postal.add_language(l);
+  postal.set_use_postal(m_use_postal);
+  postal.set_use_primitive(m_use_primitive);
+}
+
+std::string PostalService::config() const
+{
+  std::string c;
+  ForkedWorker::write_string(c, m_datadir_global);
+  ForkedWorker::write_string(c, m_datadir_country);
+  ForkedWorker::write_strings(c, m_languages);
+  ForkedWorker::write_size(c, m_use_postal ? 1 : 0);
+  ForkedWorker::write_size(c, m_use_primitive ? 1 : 0);
+  return c;
+}
+
+ForkedWorker::Handler PostalService::make_handler(const std::string &config)
+{
+  std::shared_ptr<Postal>  postal = std::make_shared<Postal>();
+  std::string              global, country;
+  std::vector<std::string> languages;
+  uint64_t                 use_postal = 1, use_primitive = 1;
+  size_t                   pos = 0;
+  if (!ForkedWorker::read_string(config, pos, global)
+      || !ForkedWorker::read_string(config, pos, country)
+      || !ForkedWorker::read_strings(config, pos, languages)
+      || !ForkedWorker::read_size(config, pos, use_postal)
+      || !ForkedWorker::read_size(config, pos, use_primitive))
+    std::cerr << "PostalService: error reading worker configuration\n";
+
+  postal->set_postal_datadir(global, country);
+  for (const std::string &l : languages)
+    postal->add_language(l);
+  postal->set_use_postal(use_postal);
+  postal->set_use_primitive(use_primitive);
+
+  return [postal](const std::string &request) { return handle(*postal, request); };
+}
+
+bool PostalService::start()
+{
+  std::lock_guard<std::mutex> lk(m_mutex);
+  if (!m_threads.empty())
+    return true;
+
+  m_stop = false;
+  for (size_t i = 0; i < m_workers; ++i)
+    {
+      std::shared_ptr<Parser> parser;
+      if (m_type == WorkerInProcess)
+        {
+          std::shared_ptr<LocalParser> p = std::make_shared<LocalParser>();
+          configure(p->postal);
+          parser = p;
+        }
+      else
+        {
+          // Postal is created and configured in the forked process
+          std::shared_ptr<ForkedParser> p = std::make_shared<ForkedParser>(config());
+          if (!p->start())
+            {
+              std::cerr << "PostalService: error starting worker process\n";
+              continue;
+            }
+          parser = p;
+        }
+
+      m_threads.push_back(std::thread(&PostalService::worker, this, parser));
+    }
+
+  return !m_threads.empty();
+}
+
+void PostalService::stop()
+{
+  {
+    std::lock_guard<std::mutex> lk(m_mutex);
+    m_stop = true;
+  }
+  m_cv.notify_all();
+
+  for (std::thread &t : m_threads)
+    t.join();
+  m_threads.clear();
+
+  // fail the requests that were left without workers
+  std::deque<Task> queue;
+  {
+    std::lock_guard<std::mutex> lk(m_mutex);
+    queue.swap(m_queue);
+  }
+  for (Task &task : queue)
+    task(nullptr);
+}
+
+void PostalService::submit(Task task)
+{
+  const bool started = start();
+  {
+    std::unique_lock<std::mutex> lk(m_mutex);
+    if (started && !m_stop)
+      {
+        m_queue.push_back(task);
+        lk.unlock();
+        m_cv.notify_one();
+        return;
+      }
+  }
+
+  // no workers to handle the request
+  task(nullptr);
+}
+
+void PostalService::worker(std::shared_ptr<Parser> parser)
+{
+  while (true)
+    {
+      Task task;
+      {
+        std::unique_lock<std::mutex> lk(m_mutex);
+        m_cv.wait(lk, [this]() { return m_stop || !m_queue.empty(); });
+
+        // finish queued requests before stopping
+        if (m_queue.empty())
+          return;
+
+        task = m_queue.front();
+        m_queue.pop_front();
+      }
+
+      task(parser.get());
+    }
+}
+
+std::future<PostalService::ParseReply> PostalService::parse(const std::string &input)
+{
+  std::shared_ptr<std::promise<ParseReply> > promise
+      = std::make_shared<std::promise<ParseReply> >();
+  submit([promise, input](Parser *parser) {
+    ParseReply reply;
+    reply.ok = parser && parser->parse(input, reply.parsed, reply.nonormalization);
+    promise->set_value(reply);
+  });
+  return promise->get_future();
+}
+
+std::future<std::vector<std::string> > PostalService::expand_string(const std::string &input)
+{
+  std::shared_ptr<std::promise<std::vector<std::string> > > promise
+      = std::make_shared<std::promise<std::vector<std::string> > >();
+  submit([promise, input](Parser *parser) {
+    std::vector<std::string> expansions;
+    if (parser)
+      parser->expand_string(input, expansions);
+    promise->set_value(expansions);
+  });
+  return promise->get_future();
+}
+
+std::string PostalService::handle(Postal &postal, const std::string &request)
+{
+  std::string response;
+  if (request.empty())
+    return response;
+
+  const std::string input = request.substr(1);
+  if (request[0] == request_parse)
+    {
+      std::vector<Postal::ParseResult> parsed;
+      Postal::ParseResult              nonormalization;
+      bool                             ok = postal.parse(input, parsed, nonormalization);
+
+      ForkedWorker::write_string(response, ok ? "1" : "0");
+      write_parse_result(response, nonormalization);
+      ForkedWorker::write_size(response, parsed.size());
+      for (const Postal::ParseResult &r : parsed)
+        write_parse_result(response, r);
+    }
+  else if (request[0] == request_expand)
+    {
+      std::vector<std::string> expansions;
+      postal.expand_string(input, expansions);
+      ForkedWorker::write_strings(response, expansions);
+    }
+
+  return response;
+}
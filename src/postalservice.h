@@ -0,0 +1,133 @@
+#ifndef GEOCODER_POSTALSERVICE_H
+#define GEOCODER_POSTALSERVICE_H
+
+#include "forkedworker.h"
+#include "postal.h"
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace GeoNLP
+{
+
+/// \brief Address parsing service for multithreaded callers
+///
+/// libpostal has global state and can be used only by one thread at
+/// a time. PostalService queues parsing requests from any number of
+/// threads and passes them to the workers. Results are returned as
+/// futures, so the callers can keep several requests in flight.
+///
+/// With the in-process worker, requests are handled one at a time
+/// by a single Postal instance. With forked workers, each worker is
+/// a separate process with its own libpostal, and the requests are
+/// handled in parallel. Note that each forked worker loads its own
+/// copy of libpostal data.
+///
+/// Forked workers are started by a zygote process, see
+/// ForkedWorker. The zygote has to be forked while the program has a
+/// single thread: call initialize() at the start of the program or
+/// create the forked services before starting other threads. The
+/// zygote is forked by the constructor of the first forked service
+/// otherwise.
+class PostalService
+{
+public:
+  enum WorkerType
+  {
+    WorkerInProcess,
+    WorkerForked
+  };
+
+  struct ParseReply
+  {
+    bool                             ok = false;
+    std::vector<Postal::ParseResult> parsed;
+    Postal::ParseResult              nonormalization;
+  };
+
+public:
+  /// \brief Create service. Number of in-process workers is always one
+  PostalService(WorkerType type = WorkerInProcess, size_t workers = 1);
+  ~PostalService();
+
+  PostalService(const PostalService &) = delete;
+  PostalService &operator=(const PostalService &) = delete;
+
+  /// \brief Prepare forked workers, call before starting any threads
+  static bool initialize();
+
+  /// \brief Configuration of Postal used by the workers, applied on start
+  void set_postal_datadir(const std::string &global, const std::string &country);
+  void add_language(const std::string &lang);
+  void set_use_postal(bool v) { m_use_postal = v; }
+  void set_use_primitive(bool v) { m_use_primitive = v; }
+
+  /// \brief Start the workers, called on the first request if needed
+  bool start();
+  void stop();
+
+  /// \brief Queue request for the workers
+  ///
+  /// If the workers cannot be started, the request fails immediately:
+  /// the reply is not ok and the list of expansions is empty.
+  std::future<ParseReply>                parse(const std::string &input);
+  std::future<std::vector<std::string> > expand_string(const std::string &input);
+
+public:
+  // parser used by a worker
+  class Parser
+  {
+  public:
+    virtual ~Parser() {}
+    virtual bool parse(const std::string &input, std::vector<Postal::ParseResult> &parsed,
+                       Postal::ParseResult &nonormalization)
+        = 0;
+    virtual void expand_string(const std::string &input, std::vector<std::string> &expansions)
+        = 0;
+  };
+
+  // task is called without parser when there is no worker to handle it
+  typedef std::function<void(Parser *)> Task;
+
+protected:
+  void configure(Postal &postal) const;
+  void submit(Task task);
+  void worker(std::shared_ptr<Parser> parser);
+
+public:
+  // handler of the forked worker process made from serialized configuration
+  static ForkedWorker::Handler make_handler(const std::string &config);
+
+protected:
+  std::string config() const;
+
+  // request handling in forked worker process
+  static std::string handle(Postal &postal, const std::string &request);
+
+protected:
+  WorkerType m_type;
+  size_t     m_workers;
+
+  std::string              m_datadir_global;
+  std::string              m_datadir_country;
+  std::vector<std::string> m_languages;
+  bool                     m_use_postal    = true;
+  bool                     m_use_primitive = true;
+
+  std::mutex               m_mutex;
+  std::condition_variable  m_cv;
+  std::deque<Task>         m_queue;
+  std::vector<std::thread> m_threads;
+  bool                     m_stop = false;
+};
+
+}
+
+#endif // GEOCODER_POSTALSERVICE_H
@@ -0,0 +1,191 @@
+#include "queryclassifier.h"
+
+#include <algorithm>
+#include <cctype>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+
+using namespace GeoNLP;
+
+#define PRIMITIVE_ADDRESS_PARSER_POSTAL_CODE_INPUT "post:"
+
+// longest postal code accepted by the fast path, characters
+const size_t max_postal_code_length = 10;
+
+static std::string trimmed(const std::string &s)
+{
+  size_t b = 0, e = s.length();
+  while (b < e && std::isspace((unsigned char)s[b]))
+    ++b;
+  while (e > b && std::isspace((unsigned char)s[e - 1]))
+    --e;
+  return s.substr(b, e - b);
+}
+
+QueryClassifier::Kind QueryClassifier::classify(const std::string &query, double &latitude,
+                                                double &longitude, std::string &value)
+{
+  const std::string q = trimmed(query);
+
+  if (parse_coordinates(q, latitude, longitude))
+    return KindCoordinates;
+
+  // primitive parser input with the postal code only
+  const size_t np = strlen(PRIMITIVE_ADDRESS_PARSER_POSTAL_CODE_INPUT);
+  if (q.compare(0, np, PRIMITIVE_ADDRESS_PARSER_POSTAL_CODE_INPUT) == 0
+      && q.find(',') == std::string::npos)
+    {
+      value = trimmed(q.substr(np));
+      if (!value.empty())
+        return KindPostalCode;
+    }
+
+  if (is_postal_code(q))
+    {
+      value = q;
+      return KindPostalCode;
+    }
+
+  // single token, searched in lower case as the normalized strings
+  if (!q.empty()
+      && std::find_if(q.begin(), q.end(),
+                      [](unsigned char c) { return std::isspace(c) || std::ispunct(c); })
+             == q.end())
+    {
+      value.clear();
+      for (unsigned char c : q)
+        value.push_back(c < 128 ? std::tolower(c) : c);
+      return KindToken;
+    }
+
+  return KindAddress;
+}
+
+bool QueryClassifier::parse_coordinates(const std::string &query, double &latitude,
+                                        double &longitude)
+{
+  // two decimal numbers separated by comma and/or spaces
+  const char *s = query.c_str();
+  char       *end;
+
+  if (strchr(s, '.') == nullptr)
+    return false;
+
+  latitude = strtod(s, &end);
+  if (end == s || memchr(s, '.', end - s) == nullptr)
+    return false;
+
+  s = end;
+  while (std::isspace((unsigned char)*s))
+    ++s;
+  if (*s == ',')
+    ++s;
+  if (s == end)
+    return false;
+
+  longitude = strtod(s, &end);
+  if (end == s || memchr(s, '.', end - s) == nullptr || *end != 0)
+    return false;
+
+  return std::isfinite(latitude) && std::isfinite(longitude) && std::fabs(latitude) <= 90
+         && std::fabs(longitude) <= 180;
+}
+
+bool QueryClassifier::is_postal_code(const std::string &query)
+{
+  // digits and letters, optionally split into two parts by a space or
+  // a hyphen. at least two digits are required to separate them from
+  // the names
+  if (query.length() < 3 || query.length() > max_postal_code_length)
+    return false;
+
+  size_t digits = 0, separators = 0;
+  for (unsigned char c : query)
+    {
+      if (std::isdigit(c))
+        ++digits;
+      else if (c == ' ' || c == '-')
+        ++separators;
+      else if (!std::isalpha(c))
+        return false;
+    }
+
+  return digits >= 2 && separators <= 1 && std::isalnum((unsigned char)query.front())
+         && std::isalnum((unsigned char)query.back());
+}
+
+bool QueryClassifier::search(const std::string &query, std::vector<Geocoder::GeoResult> &result,
+                             size_t min_levels, const Geocoder::GeoReference &reference,
+                             const BoundingBox &viewport)
+{
+  result.clear();
+
+  double      latitude, longitude;
+  std::string value;
+  switch (classify(query, latitude, longitude, value))
+    {
+    case KindCoordinates:
+      if (!m_geocoder.search_nearby(std::vector<std::string>(), std::vector<std::string>(),
+                                    latitude, longitude, m_coordinates_radius, result, m_postal))
+        return false;
+      Geocoder::sort_by_distance(result.begin(), result.end());
+      ++m_count_coordinates;
+      return true;
+
+    case KindPostalCode:
+      {
+        ParsedQuery q;
+        q.add(ParsedQuery::PrimitivePostalCode, std::vector<std::string>(1, value));
+        if (m_geocoder.search(q, result, min_levels, reference, viewport) && !result.empty())
+          {
+            ++m_count_postal_code;
+            return true;
+          }
+        break;
+      }
+
+    case KindToken:
+      if (m_geocoder.has_normalized_key(value))
+        {
+          ParsedQuery q;
+          q.add_primitive(std::vector<std::string>(1, value));
+          if (m_geocoder.search(q, result, min_levels, reference, viewport) && !result.empty())
+            {
+              ++m_count_token;
+              return true;
+            }
+        }
+      break;
+
+    case KindAddress:
+      break;
+    }
+
+  ++m_count_address;
+
+  ParsedQuery         parsed;
+  Postal::ParseResult nonorm;
+  if (!m_postal.parse(query, parsed, nonorm))
+    return false;
+
+  return m_geocoder.search(parsed, result, min_levels, reference, viewport);
+}
+
+QueryClassifier::Statistics QueryClassifier::get_statistics() const
+{
+  Statistics s;
+  s.address     = m_count_address;
+  s.coordinates = m_count_coordinates;
+  s.postal_code = m_count_postal_code;
+  s.token       = m_count_token;
+  return s;
+}
+
+void QueryClassifier::reset_statistics()
+{
+  m_count_address     = 0;
+  m_count_coordinates = 0;
+  m_count_postal_code = 0;
+  m_count_token       = 0;
+}
@@ -0,0 +1,89 @@
+#ifndef GEOCODER_QUERYCLASSIFIER_H
+#define GEOCODER_QUERYCLASSIFIER_H
+
+#include "geocoder.h"
+#include "geometry.h"
+#include "postal.h"
+
+#include <atomic>
+#include <string>
+#include <vector>
+
+namespace GeoNLP
+{
+
+/// \brief Search for the query string with fast paths bypassing libpostal
+///
+/// Query is classified before parsing. Coordinates, as "59.43,
+/// 24.75", are searched by Geocoder::search_nearby. Postal codes,
+/// given as is or with the "post:" prefix, are searched by postal
+/// code only. Single tokens that are keys of the search index are
+/// searched directly. All other queries are parsed by Postal and
+/// searched as usual. When the search through the fast path of the
+/// postal code or the single token does not give any results, the
+/// query is parsed and searched as usual.
+///
+/// Number of queries answered by each path is counted.
+class QueryClassifier
+{
+public:
+  enum Kind
+  {
+    KindAddress,
+    KindCoordinates,
+    KindPostalCode,
+    KindToken
+  };
+
+  struct Statistics
+  {
+    size_t address     = 0;
+    size_t coordinates = 0;
+    size_t postal_code = 0;
+    size_t token       = 0;
+  };
+
+public:
+  QueryClassifier(Geocoder &geocoder, Postal &postal) : m_geocoder(geocoder), m_postal(postal) {}
+
+  /// \brief Classify query without accessing the databases
+  ///
+  /// For coordinates, latitude and longitude are filled. For postal
+  /// codes and tokens, the value to search for is given.
+  static Kind classify(const std::string &query, double &latitude, double &longitude,
+                       std::string &value);
+
+  /// \brief Search for the query, arguments are as in Geocoder::search
+  ///
+  /// Results for coordinates are sorted by distance.
+  bool search(const std::string &query, std::vector<Geocoder::GeoResult> &result,
+              size_t min_levels = 0,
+              const Geocoder::GeoReference &reference = Geocoder::GeoReference(),
+              const BoundingBox            &viewport  = BoundingBox());
+
+  /// \brief Radius in meters used to search for objects next to the coordinates
+  double get_coordinates_radius() const { return m_coordinates_radius; }
+  void   set_coordinates_radius(double radius) { m_coordinates_radius = radius; }
+
+  Statistics get_statistics() const;
+  void       reset_statistics();
+
+protected:
+  static bool parse_coordinates(const std::string &query, double &latitude, double &longitude);
+  static bool is_postal_code(const std::string &query);
+
+protected:
+  Geocoder &m_geocoder;
+  Postal   &m_postal;
+
+  double m_coordinates_radius = 100;
+
+  std::atomic<size_t> m_count_address{ 0 };
+  std::atomic<size_t> m_count_coordinates{ 0 };
+  std::atomic<size_t> m_count_postal_code{ 0 };
+  std::atomic<size_t> m_count_token{ 0 };
+};
+
+}
+
+#endif // GEOCODER_QUERYCLASSIFIER_H
@@ -0,0 +1,173 @@
+#include "spatialcell.h"
+
+#include <algorithm>
+#include <cmath>
+#include <utility>
+
+using namespace GeoNLP;
+
+// Hilbert curve index of the grid cell (x, y) on the grid with
+// 2^level cells in each direction. Prefix of the index at the finer
+// level is the index at the coarser one.
+uint64_t SpatialCell::xy2d(int level, uint64_t x, uint64_t y)
+{
+  uint64_t d = 0;
+  for (uint64_t s = (level > 0 ? (1ULL << (level - 1)) : 0); s > 0; s >>= 1)
+    {
+      const uint64_t rx = (x & s) ? 1 : 0;
+      const uint64_t ry = (y & s) ? 1 : 0;
+      d += s * s * ((3 * rx) ^ ry);
+
+      // rotate the quadrant
+      if (ry == 0)
+        {
+          if (rx == 1)
+            {
+              x = s - 1 - (x & (s - 1));
+              y = s - 1 - (y & (s - 1));
+            }
+          std::swap(x, y);
+        }
+    }
+  return d;
+}
+
+void SpatialCell::d2xy(int level, uint64_t d, uint64_t &x, uint64_t &y)
+{
+  const uint64_t n = 1ULL << level;
+  x = y = 0;
+  for (uint64_t s = 1; s < n; s <<= 1)
+    {
+      const uint64_t rx = 1 & (d / 2);
+      const uint64_t ry = 1 & (d ^ rx);
+
+      // rotate the quadrant
+      if (ry == 0)
+        {
+          if (rx == 1)
+            {
+              x = s - 1 - x;
+              y = s - 1 - y;
+            }
+          std::swap(x, y);
+        }
+
+      x += s * rx;
+      y += s * ry;
+      d /= 4;
+    }
+}
+
+uint64_t SpatialCell::grid_x(double longitude, int level)
+{
+  const double   n = (double)(1ULL << level);
+  const double   v = std::floor((longitude + 180.0) / 360.0 * n);
+  const uint64_t m = (1ULL << level) - 1;
+  return v <= 0 ? 0 : std::min((uint64_t)v, m);
+}
+
+uint64_t SpatialCell::grid_y(double latitude, int level)
+{
+  const double   n = (double)(1ULL << level);
+  const double   v = std::floor((latitude + 90.0) / 180.0 * n);
+  const uint64_t m = (1ULL << level) - 1;
+  return v <= 0 ? 0 : std::min((uint64_t)v, m);
+}
+
+uint64_t SpatialCell::id(double latitude, double longitude)
+{
+  return xy2d(max_level, grid_x(longitude, max_level), grid_y(latitude, max_level));
+}
+
+uint64_t SpatialCell::parent(uint64_t id, int level)
+{
+  return id >> (2 * (max_level - level));
+}
+
+SpatialCell::Range SpatialCell::range(uint64_t cell, int level)
+{
+  const int shift = 2 * (max_level - level);
+  Range     r;
+  r.first = cell << shift;
+  r.last  = ((cell + 1) << shift) - 1;
+  return r;
+}
+
+BoundingBox SpatialCell::bounds(uint64_t cell, int level)
+{
+  uint64_t x, y;
+  d2xy(level, cell, x, y);
+  const double n = (double)(1ULL << level);
+  return BoundingBox(y / n * 180.0 - 90.0, (y + 1) / n * 180.0 - 90.0, x / n * 360.0 - 180.0,
+                     (x + 1) / n * 360.0 - 180.0);
+}
+
+int SpatialCell::level(double size)
+{
+  int l = 0;
+  while (l < max_level && 180.0 / (1ULL << (l + 1)) * distance_per_latitude() >= size)
+    ++l;
+  return l;
+}
+
+std::vector<uint64_t> SpatialCell::cells(const BoundingBox &box, int level)
+{
+  std::vector<uint64_t> result;
+  if (box.empty())
+    return result;
+
+  const uint64_t x0 = grid_x(box.min_longitude, level);
+  const uint64_t x1 = grid_x(box.max_longitude, level);
+  const uint64_t y0 = grid_y(box.min_latitude, level);
+  const uint64_t y1 = grid_y(box.max_latitude, level);
+  for (uint64_t x = x0; x <= x1; ++x)
+    for (uint64_t y = y0; y <= y1; ++y)
+      result.push_back(xy2d(level, x, y));
+
+  return result;
+}
+
+std::vector<SpatialCell::Range> SpatialCell::cover(const BoundingBox &box, size_t max_cells)
+{
+  std::vector<Range> result;
+  if (box.empty())
+    return result;
+
+  // find the finest level at which the box is covered by at most max_cells
+  int level = max_level;
+  for (; level > 0; --level)
+    {
+      const uint64_t nx = grid_x(box.max_longitude, level) - grid_x(box.min_longitude, level) + 1;
+      const uint64_t ny = grid_y(box.max_latitude, level) - grid_y(box.min_latitude, level) + 1;
+      if (nx * ny <= std::max(max_cells, (size_t)1))
+        break;
+    }
+
+  for (uint64_t c : cells(box, level))
+    result.push_back(range(c, level));
+
+  merge(result);
+  return result;
+}
+
+void SpatialCell::merge(std::vector<Range> &ranges)
+{
+  if (ranges.empty())
+    return;
+
+  std::sort(ranges.begin(), ranges.end(),
+            [](const Range &a, const Range &b) { return a.first < b.first; });
+
+  std::vector<Range> merged;
+  merged.push_back(ranges.front());
+  for (size_t i = 1; i < ranges.size(); ++i)
+    {
+      Range &last = merged.back();
+      if (ranges[i].first <= last.last + 1)
+        last.last = std::max(last.last, ranges[i].last);
+      else
+        merged.push_back(ranges[i]);
+    }
+
+  ranges.swap(merged);
+}
@@ -0,0 +1,66 @@
+#ifndef GEOCODER_SPATIALCELL_H
+#define GEOCODER_SPATIALCELL_H
+
+#include "geometry.h"
+
+#include <cstdint>
+#include <vector>
+
+namespace GeoNLP
+{
+
+/// \brief Cells of Hilbert space-filling curve used for spatial queries
+///
+/// Longitude and latitude are mapped onto 2^31 x 2^31 grid and the
+/// grid cells are ordered along Hilbert curve. Each location is
+/// assigned 62-bit cell id at the full resolution. Cells at coarser
+/// levels cover contiguous ranges of the full resolution ids, so
+/// spatial windows can be queried as a few id range scans.
+class SpatialCell
+{
+public:
+  static const int max_level = 31;
+
+  /// \brief Range of full resolution cell ids, inclusive
+  struct Range
+  {
+    uint64_t first;
+    uint64_t last;
+  };
+
+public:
+  /// \brief Full resolution cell id of the location
+  static uint64_t id(double latitude, double longitude);
+
+  /// \brief Index of the cell at the given level that contains the full resolution id
+  static uint64_t parent(uint64_t id, int level);
+
+  /// \brief Range of full resolution ids covered by the cell at the given level
+  static Range range(uint64_t cell, int level);
+
+  /// \brief Bounding box of the cell at the given level
+  static BoundingBox bounds(uint64_t cell, int level);
+
+  /// \brief Finest level with the cells that are at least size meters along latitude
+  static int level(double size);
+
+  /// \brief Cells at the given level that cover the box
+  static std::vector<uint64_t> cells(const BoundingBox &box, int level);
+
+  /// \brief Covering of the box by at most max_cells cells given as sorted id ranges
+  static std::vector<Range> cover(const BoundingBox &box, size_t max_cells = 16);
+
+  /// \brief Sort ranges and merge the ones that are adjacent or overlap
+  static void merge(std::vector<Range> &ranges);
+
+protected:
+  static uint64_t xy2d(int level, uint64_t x, uint64_t y);
+  static void     d2xy(int level, uint64_t d, uint64_t &x, uint64_t &y);
+
+  static uint64_t grid_x(double longitude, int level);
+  static uint64_t grid_y(double latitude, int level);
+};
+
+}
+
+#endif // GEOCODER_SPATIALCELL_H